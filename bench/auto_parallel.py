@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+"""Compares the programs in bench/parallel with and without --auto-parallel.
+
+Runs of the two modes are interleaved, so that both see the same load, and
+the median times and the speedup of each program are printed as JSON. The
+interpreter uses one thread per CPU, and evaluates in order on a single CPU.
+"""
+
+import argparse
+import json
+import os
+import sys
+
+import run
+
+PARALLEL_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                            "parallel")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--mlisp", default="./mlisp",
+                        help="interpreter to benchmark (default: ./mlisp)")
+    parser.add_argument("-n", "--runs", type=int, default=5,
+                        help="runs of each program and mode (default: 5)")
+    args = parser.parse_args()
+
+    results = {"mlisp": args.mlisp, "cpus": os.cpu_count(), "benchmarks": {}}
+    for name in sorted(f[:-2] for f in os.listdir(PARALLEL_DIR)
+                       if f.endswith(".l")):
+        print("running %s" % name, file=sys.stderr)
+        path = os.path.join(PARALLEL_DIR, name + ".l")
+        sequential, parallel = [], []
+        for _ in range(args.runs):
+            sequential.append(run.run_once(args.mlisp, path)["real_ms"])
+            parallel.append(run.run_once(args.mlisp, path,
+                                         ["--auto-parallel"])["real_ms"])
+        results["benchmarks"][name] = {
+            "sequential_ms": run.median(sequential),
+            "parallel_ms": run.median(parallel),
+            "speedup": run.median(sequential) / run.median(parallel),
+        }
+    print(json.dumps(results, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,184 @@
+// Microbenchmarks of the hot paths of mlisp, built from its own sources.
+//
+// Each benchmark is run in batches of calibrated size, and the median time
+// per operation of the batches is printed as JSON, one benchmark per line so
+// that results of two commits diff well.
+//
+//     micro [-t MS_PER_BATCH] [-b BATCHES] [FILTER]
+
+#define MLISP_NO_MAIN
+#include "../main.cpp"
+
+// Keeps the compiler from optimizing away the computation of `value`.
+template <typename T>
+void keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct MicroResult {
+    std::string name;
+    unsigned long iterations;
+    double ns_per_op;
+    // Throughput per second in `unit`, which is derived from `per_op`.
+    std::string unit;
+    double per_op;
+};
+
+static double MS_PER_BATCH = 20;
+static int BATCHES = 7;
+static std::string FILTER;
+static std::vector<MicroResult> RESULTS;
+
+// Measures `op`, which performs one operation worth `per_op` of `unit`.
+template <typename F>
+void measure(const std::string &name, const std::string &unit, double per_op,
+             F op) {
+    if (name.find(FILTER) == std::string::npos) {
+        return;
+    }
+    auto time_batch = [&](unsigned long iterations) {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned long i = 0; i < iterations; i++) {
+            op(i);
+        }
+        return std::chrono::duration<double, std::nano>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    };
+
+    unsigned long iterations = 1;
+    while (time_batch(iterations) < MS_PER_BATCH * 1e6 / 4) {
+        iterations *= 2;
+    }
+    iterations *= 4;
+    std::vector<double> samples;
+    for (int i = 0; i < BATCHES; i++) {
+        samples.push_back(time_batch(iterations) / iterations);
+    }
+    std::sort(samples.begin(), samples.end());
+    RESULTS.push_back(MicroResult{name, iterations,
+                                  samples[samples.size() / 2], unit, per_op});
+    std::cerr << name << std::endl;
+}
+
+std::string lex_input() {
+    const std::string snippet =
+        "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+        "(setq pi 3.14159 name \"mlisp\" xs '(1 2 3) ys `(a ,b ,@c))\n";
+    std::string input;
+    while (input.size() < 1024 * 1024) {
+        input += snippet;
+    }
+    return input;
+}
+
+void bench_lex_parse() {
+    auto input = lex_input();
+    measure("lex", "MB", input.size() / 1e6,
+            [&](unsigned long) { keep(lex(input).size()); });
+
+    auto tokens = lex(input);
+    double forms = parse(tokens).size();
+    measure("parse", "forms", forms,
+            [&](unsigned long) { keep(parse(tokens).size()); });
+}
+
+void bench_env() {
+    for (size_t size : {1, 16, 256, 4096}) {
+        Env env;
+        std::vector<std::string> syms;
+        for (size_t i = 0; i < size; i++) {
+            syms.push_back("symbol-" + std::to_string(i));
+            env.set_obj(syms.back(), GLOBAL_T);
+        }
+        env.compact();
+        std::string suffix = "/" + std::to_string(size);
+
+        measure("env_get" + suffix, "ops", 1, [&](unsigned long i) {
+            keep(env.get_obj(syms[i % size]).get());
+        });
+        measure("env_set" + suffix, "ops", 1, [&](unsigned long i) {
+            env.set_obj(syms[i % size], GLOBAL_NIL);
+        });
+    }
+}
+
+void bench_apply_func() {
+    Env env = default_env();
+    auto func = std::static_pointer_cast<Function>(
+        eval(parse(lex("(lambda (x) x)"))[0], env));
+    auto args = make_object<List>(make_object<Integer>(1));
+    measure("apply_func", "calls", 1, [&](unsigned long) {
+        keep(apply_func(func, args, env).get());
+    });
+
+    auto thunk = std::static_pointer_cast<Function>(
+        eval(parse(lex("(lambda () NIL)"))[0], env));
+    measure("apply_func/no_args", "calls", 1, [&](unsigned long) {
+        keep(apply_func(thunk, nullptr, env).get());
+    });
+}
+
+void bench_arithmetic() {
+    Env env = default_env();
+    using Buildin = std::shared_ptr<Object> (*)(const std::shared_ptr<List>,
+                                                Env &);
+    const std::vector<std::pair<std::string, Buildin>> buildins = {
+        {"+", fn_add_num}, {"-", fn_sub_num}, {"*", fn_mul_num},
+        {"/", fn_div_num}, {"=", fn_eq_num},  {"/=", fn_ne_num},
+        {"<", fn_lt_num},  {">", fn_gt_num},  {"<=", fn_le_num},
+        {">=", fn_ge_num},
+    };
+    auto ints = make_object<List>(make_object<Integer>(7),
+                                  make_object<List>(make_object<Integer>(3)));
+    auto nums = make_object<List>(make_object<Number>(7.5),
+                                  make_object<List>(make_object<Number>(3.5)));
+    for (const auto &buildin : buildins) {
+        measure("arith(" + buildin.first + ")/integer", "ops", 1,
+                [&](unsigned long) { keep(buildin.second(ints, env).get()); });
+        measure("arith(" + buildin.first + ")/number", "ops", 1,
+                [&](unsigned long) { keep(buildin.second(nums, env).get()); });
+    }
+}
+
+void print_results(std::ostream &os) {
+    os << "{\"benchmarks\": [\n";
+    char line[512];
+    for (size_t i = 0; i < RESULTS.size(); i++) {
+        const auto &result = RESULTS[i];
+        std::snprintf(line, sizeof(line),
+                      "  {\"name\": \"%s\", \"iterations\": %lu, "
+                      "\"ns_per_op\": %.3f, \"%s_per_s\": %.1f}%s\n",
+                      result.name.c_str(), result.iterations,
+                      result.ns_per_op, result.unit.c_str(),
+                      result.per_op * 1e9 / result.ns_per_op,
+                      i + 1 < RESULTS.size() ? "," : "");
+        os << line;
+    }
+    os << "]}" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            MS_PER_BATCH = std::atof(argv[++i]);
+        } else if (arg == "-b" && i + 1 < argc) {
+            BATCHES = std::max(1, std::atoi(argv[++i]));
+        } else if (arg.rfind("-", 0) == 0) {
+            std::cerr << "usage: " << argv[0]
+                      << " [-t MS_PER_BATCH] [-b BATCHES] [FILTER]"
+                      << std::endl;
+            return 1;
+        } else {
+            FILTER = arg;
+        }
+    }
+
+    bench_lex_parse();
+    bench_env();
+    bench_apply_func();
+    bench_arithmetic();
+    print_results(std::cout);
+    return 0;
+}
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+"""Fails when the benchmarks got slower than the stored baseline.
+
+Runs every benchmark of bench/run.py several times and compares the median
+time with the one in the baseline. A benchmark regressed when its median grew
+by more than the threshold and the 95% bootstrap confidence interval of the
+ratio of the medians lies entirely above 1, so that noise alone rarely fails
+the check. Baselines are only comparable on the machine they were made on.
+
+With --against REV, the baseline is instead an interpreter built from the git
+revision REV, whose runs are interleaved with those of the checked one, so
+that both see the same machine load.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import run
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "baseline.json")
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+RESAMPLES = 2000
+
+
+def ratio_interval(baseline, current, rng):
+    """95% bootstrap confidence interval of median(current) / median(baseline).
+    """
+    ratios = []
+    for _ in range(RESAMPLES):
+        b = run.median([rng.choice(baseline) for _ in baseline])
+        c = run.median([rng.choice(current) for _ in current])
+        ratios.append(c / b)
+    ratios.sort()
+    return (ratios[int(RESAMPLES * 0.025)],
+            ratios[int(RESAMPLES * 0.975) - 1])
+
+
+def compare(baseline, current, threshold):
+    """Prints a table of the changes and returns the names which regressed."""
+    rng = random.Random(0)
+    regressed = []
+    rows = [("benchmark", "baseline ms", "current ms", "change", "95% CI",
+             "eval steps", "status")]
+    for name, result in sorted(current["benchmarks"].items()):
+        base = baseline["benchmarks"].get(name)
+        if base is None:
+            rows.append((name, "-", "%.2f" % result["median_ms"], "-", "-",
+                         "-", "new"))
+            continue
+        ratio = result["median_ms"] / base["median_ms"]
+        low, high = ratio_interval(base["samples_ms"], result["samples_ms"],
+                                   rng)
+        if ratio > 1 + threshold and low > 1:
+            status = "REGRESSED"
+            regressed.append(name)
+        elif ratio < 1 - threshold and high < 1:
+            status = "improved"
+        else:
+            status = "ok"
+        steps = result["eval_steps"] - base["eval_steps"]
+        rows.append((name, "%.2f" % base["median_ms"],
+                     "%.2f" % result["median_ms"],
+                     "%+.1f%%" % ((ratio - 1) * 100),
+                     "[%+.1f%%, %+.1f%%]" % ((low - 1) * 100,
+                                             (high - 1) * 100),
+                     "%+d" % steps if steps else "=", status))
+
+    widths = [max(len(row[i]) for row in rows) for i in range(len(rows[0]))]
+    for row in rows:
+        print("  ".join(cell.ljust(width)
+                        for cell, width in zip(row, widths)).rstrip())
+    return regressed
+
+
+def run_interleaved(baseline_mlisp, mlisp, names, runs):
+    """Runs every benchmark with both interpreters in turn."""
+    baseline = {"mlisp": baseline_mlisp, "benchmarks": {}}
+    current = {"mlisp": mlisp, "benchmarks": {}}
+    for name in names:
+        print("running %s" % name, file=sys.stderr)
+        path = os.path.join(run.PROGRAMS_DIR, name + ".l")
+        baseline_samples, samples = [], []
+        for _ in range(runs):
+            baseline_samples.append(run.run_once(baseline_mlisp, path))
+            samples.append(run.run_once(mlisp, path))
+        baseline["benchmarks"][name] = run.summarize(baseline_samples)
+        current["benchmarks"][name] = run.summarize(samples)
+    return baseline, current
+
+
+def build_revision(rev, directory):
+    """Builds the interpreter of the git revision `rev` in `directory`."""
+    subprocess.run(["git", "-C", ROOT, "worktree", "add", "--detach",
+                    directory, rev], check=True, stdout=subprocess.DEVNULL)
+    subprocess.run(["make", "-C", directory, "compile"], check=True,
+                   stdout=subprocess.DEVNULL)
+    return os.path.join(directory, "mlisp")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--mlisp", default="./mlisp",
+                        help="interpreter to check (default: ./mlisp)")
+    parser.add_argument("-n", "--runs", type=int, default=10,
+                        help="runs of each benchmark (default: 10)")
+    parser.add_argument("--threshold", type=float, default=10,
+                        help="regression threshold in percent (default: 10)")
+    parser.add_argument("--baseline", default=BASELINE,
+                        help="baseline JSON (default: bench/baseline.json)")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="store the results as the new baseline")
+    parser.add_argument("--against", metavar="REV",
+                        help="compare with runs of a build of this git "
+                        "revision instead of the baseline JSON")
+    args = parser.parse_args()
+
+    names = sorted(f[:-2] for f in os.listdir(run.PROGRAMS_DIR)
+                   if f.endswith(".l"))
+    if args.against:
+        directory = tempfile.mkdtemp(prefix="perf-check-")
+        try:
+            baseline_mlisp = build_revision(args.against, directory)
+            baseline, current = run_interleaved(baseline_mlisp, args.mlisp,
+                                                names, args.runs)
+        finally:
+            subprocess.run(["git", "-C", ROOT, "worktree", "remove",
+                            "--force", directory])
+            shutil.rmtree(directory, ignore_errors=True)
+        return report(baseline, current, args.threshold)
+
+    current = {"mlisp": args.mlisp, "benchmarks": {}}
+    for name in names:
+        print("running %s" % name, file=sys.stderr)
+        current["benchmarks"][name] = run.run_benchmark(args.mlisp, name,
+                                                        args.runs)
+
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(current, f, indent=2)
+            f.write("\n")
+        print("updated %s" % args.baseline)
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    return report(baseline, current, args.threshold)
+
+
+def report(baseline, current, threshold):
+    """Prints the comparison and returns the exit status of the check."""
+    regressed = compare(baseline, current, threshold / 100)
+    if regressed:
+        print("\n%d of %d benchmarks regressed by more than %g%%: %s" %
+              (len(regressed), len(current["benchmarks"]), threshold,
+               ", ".join(regressed)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Runs the benchmark programs and prints their stats as JSON.
+
+Every program in bench/programs wraps its workload in `(time ...)`, so the
+times exclude start up. Each program is run several times and the median and
+95th percentile of its times are reported, together with its peak RSS and
+the counts `time` prints, which don't vary between runs.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+PROGRAMS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                            "programs")
+
+TIME_PATTERNS = {
+    "real_ms": re.compile(r"^real time: ([0-9.]+) ms$", re.M),
+    "user_ms": re.compile(r"^user time: ([0-9.]+) ms$", re.M),
+    "system_ms": re.compile(r"^system time: ([0-9.]+) ms$", re.M),
+    "eval_steps": re.compile(r"^eval steps: ([0-9]+)$", re.M),
+    "calls": re.compile(r"^function calls: ([0-9]+)$", re.M),
+}
+ALLOCATED_PATTERN = re.compile(
+    r"^allocated: ([0-9]+) bytes in ([0-9]+) objects$", re.M)
+
+
+def percentile(samples, p):
+    """Nearest rank percentile."""
+    ordered = sorted(samples)
+    rank = max(1, -(-len(ordered) * p // 100))
+    return ordered[int(rank) - 1]
+
+
+def median(samples):
+    ordered = sorted(samples)
+    mid = len(ordered) // 2
+    if len(ordered) % 2:
+        return ordered[mid]
+    return (ordered[mid - 1] + ordered[mid]) / 2
+
+
+def run_once(mlisp, path, flags=()):
+    # stderr goes to a file, so that only one pipe is read and neither can
+    # fill up while the other is drained. The child is reaped with wait4 for
+    # its resource usage, which communicate() would discard.
+    with tempfile.TemporaryFile(mode="w+") as err_file:
+        proc = subprocess.Popen([mlisp, *flags, path],
+                                stdout=subprocess.PIPE,
+                                stderr=err_file, text=True)
+        out = proc.stdout.read()
+        proc.stdout.close()
+        _, status, usage = os.wait4(proc.pid, 0)
+        err_file.seek(0)
+        err = err_file.read()
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with %d: %s" %
+                           (path, proc.returncode, err.strip()))
+
+    stats = {"result": out.strip(), "peak_rss_kb": usage.ru_maxrss}
+    for key, pattern in TIME_PATTERNS.items():
+        matches = pattern.findall(err)
+        if not matches:
+            raise RuntimeError("%s printed no time stats" % path)
+        value = matches[-1]
+        stats[key] = float(value) if key.endswith("_ms") else int(value)
+    allocated = ALLOCATED_PATTERN.findall(err)[-1]
+    stats["allocated_bytes"] = int(allocated[0])
+    stats["allocated_objects"] = int(allocated[1])
+    return stats
+
+
+def summarize(samples):
+    """Reduces the stats of the runs of a program to one result."""
+    real = [s["real_ms"] for s in samples]
+    last = samples[-1]
+    return {
+        "runs": len(samples),
+        "median_ms": median(real),
+        "p95_ms": percentile(real, 95),
+        "min_ms": min(real),
+        "max_ms": max(real),
+        "samples_ms": real,
+        "user_ms": median([s["user_ms"] for s in samples]),
+        "system_ms": median([s["system_ms"] for s in samples]),
+        "peak_rss_kb": max(s["peak_rss_kb"] for s in samples),
+        "eval_steps": last["eval_steps"],
+        "calls": last["calls"],
+        "allocated_bytes": last["allocated_bytes"],
+        "allocated_objects": last["allocated_objects"],
+        "result": last["result"],
+    }
+
+
+def run_benchmark(mlisp, name, runs):
+    path = os.path.join(PROGRAMS_DIR, name + ".l")
+    return summarize([run_once(mlisp, path) for _ in range(runs)])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--mlisp", default="./mlisp",
+                        help="interpreter to benchmark (default: ./mlisp)")
+    parser.add_argument("-n", "--runs", type=int, default=5,
+                        help="runs of each program (default: 5)")
+    parser.add_argument("-o", "--output", help="write the JSON here too")
+    parser.add_argument("names", nargs="*",
+                        help="programs to run (default: all)")
+    args = parser.parse_args()
+
+    names = args.names or sorted(
+        f[:-2] for f in os.listdir(PROGRAMS_DIR) if f.endswith(".l"))
+    results = {"mlisp": args.mlisp, "benchmarks": {}}
+    for name in names:
+        print("running %s" % name, file=sys.stderr)
+        results["benchmarks"][name] = run_benchmark(args.mlisp, name,
+                                                    args.runs)
+
+    text = json.dumps(results, indent=2)
+    print(text)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()
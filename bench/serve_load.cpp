@@ -0,0 +1,165 @@
+// Load generator for `mlisp --serve`.
+//
+// Opens CLIENTS connections, each of which sends REQUESTS requests one at a
+// time, and reports the throughput and the latency percentiles.
+//
+//     serve_load SOCKET [-c CLIENTS] [-n REQUESTS] [-e EXPR]
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        auto n = write(fd, data, size);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char *data, size_t size) {
+    while (size > 0) {
+        auto n = read(fd, data, size);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+int connect_to(const std::string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends `count` requests, appending the latency of each in nanoseconds.
+// Returns the number of error responses, or -1 on a broken connection.
+int run_client(const std::string &path, const std::string &expr, int count,
+               std::vector<uint64_t> &latencies) {
+    int fd = connect_to(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint32_t len = htonl(static_cast<uint32_t>(expr.size()));
+    std::string frame(reinterpret_cast<const char *>(&len), sizeof(len));
+    frame += expr;
+    int errors = 0;
+    for (int i = 0; i < count; i++) {
+        auto start = std::chrono::steady_clock::now();
+        char header[5];
+        if (!write_all(fd, frame.data(), frame.size()) ||
+            !read_all(fd, header, sizeof(header))) {
+            close(fd);
+            return -1;
+        }
+        uint32_t body_len;
+        std::memcpy(&body_len, header + 1, sizeof(body_len));
+        std::string body(ntohl(body_len), '\0');
+        if (!read_all(fd, &body[0], body.size())) {
+            close(fd);
+            return -1;
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                .count());
+        if (header[0] != 0) {
+            errors++;
+        }
+    }
+    close(fd);
+    return errors;
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " SOCKET [-c CLIENTS] [-n REQUESTS] [-e EXPR]"
+                  << std::endl;
+        return 1;
+    }
+
+    std::string path = argv[1];
+    int clients = 4;
+    int requests = 10000;
+    std::string expr = "(+ 1 2)";
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string opt = argv[i];
+        if (opt == "-c") {
+            clients = std::atoi(argv[i + 1]);
+        } else if (opt == "-n") {
+            requests = std::atoi(argv[i + 1]);
+        } else if (opt == "-e") {
+            expr = argv[i + 1];
+        }
+    }
+
+    std::vector<std::vector<uint64_t>> latencies(clients);
+    std::vector<int> errors(clients);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < clients; i++) {
+        threads.emplace_back([&, i] {
+            errors[i] = run_client(path, expr, requests, latencies[i]);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+    std::vector<uint64_t> all;
+    int total_errors = 0;
+    for (int i = 0; i < clients; i++) {
+        if (errors[i] < 0) {
+            std::cerr << "client " << i << " lost its connection" << std::endl;
+            return 1;
+        }
+        total_errors += errors[i];
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    std::sort(all.begin(), all.end());
+
+    std::cout << "requests: " << all.size() << " (" << total_errors
+              << " errors)" << std::endl;
+    std::cout << "throughput: " << all.size() / elapsed << " req/s"
+              << std::endl;
+    std::cout << "p50: " << percentile(all, 50) << " us" << std::endl;
+    std::cout << "p99: " << percentile(all, 99) << " us" << std::endl;
+    std::cout << "max: " << percentile(all, 100) << " us" << std::endl;
+}
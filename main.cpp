@@ -1,20 +1,66 @@
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <istream>
 #include <iterator>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+// USDT probes for bpftrace and other tracers, which are a single nop until a
+// tracer attaches to them. Without <sys/sdt.h> they compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MLISP_HAVE_SDT
+#endif
+#endif
+
+#ifdef MLISP_HAVE_SDT
+#define MLISP_PROBE1(name, a1) DTRACE_PROBE1(mlisp, name, a1)
+#define MLISP_PROBE2(name, a1, a2) DTRACE_PROBE2(mlisp, name, a1, a2)
+#else
+#define MLISP_PROBE1(name, a1) ((void)0)
+#define MLISP_PROBE2(name, a1, a2) ((void)0)
+#endif
+
 enum class TokenKind {
     LParen,
     RParen,
@@ -28,11 +74,27 @@ enum class TokenKind {
     String,
 };
 
+// Where a token starts in its source. Lines and columns count from 1.
+struct SourcePosition {
+    size_t offset;
+    uint32_t line;
+    uint32_t column;
+};
+
 class Token {
+private:
+    SourcePosition position = {0, 0, 0};
+
 public:
     virtual ~Token() {}
     virtual TokenKind kind() const = 0;
     virtual std::string debug() const = 0;
+
+    const SourcePosition &get_position() const { return position; }
+
+    void set_position(const SourcePosition &position) {
+        this->position = position;
+    }
 };
 
 class LParenToken : public Token {
@@ -121,14 +183,19 @@ public:
     std::string debug() const override { return "\"" + string + "\""; }
 };
 
+// Counts an exception of the interpreter being thrown.
+void count_exception();
+
 class LexException : public std::runtime_error {
 public:
-    LexException(const std::string &msg) : std::runtime_error(msg) {}
+    LexException(const std::string &msg) : std::runtime_error(msg) {
+        count_exception();
+    }
 };
 
 bool is_ident_head_elem(char c) noexcept {
     return isalpha(c) || c == '+' || c == '-' || c == '*' || c == '/' ||
-           c == '=' || c == '<' || c == '>' || c == '&';
+           c == '=' || c == '<' || c == '>' || c == '&' || c == ':';
 }
 
 bool is_ident_tail_elem(char c) noexcept {
@@ -217,10 +284,23 @@ std::vector<std::shared_ptr<Token>> lex(const std::string &input) {
     std::vector<std::shared_ptr<Token>> tokens;
     auto it = input.begin();
     const auto last = input.end();
+    // Lines are counted up to the start of each token.
+    auto counted = input.begin(), line_start = input.begin();
+    uint32_t line = 1;
     while (true) {
         skip_whitespaces(it, last);
         if (it != last) {
+            for (; counted != it; counted++) {
+                if (*counted == '\n') {
+                    line++;
+                    line_start = counted + 1;
+                }
+            }
+            SourcePosition position = {
+                static_cast<size_t>(it - input.begin()), line,
+                static_cast<uint32_t>(it - line_start) + 1};
             tokens.push_back(token(it, last));
+            tokens.back()->set_position(position);
         } else {
             break;
         }
@@ -250,54 +330,355 @@ enum class ObjectKind {
     PartiallyAppliedFuncPtr,
 };
 
+const int OBJECT_KIND_COUNT =
+    static_cast<int>(ObjectKind::PartiallyAppliedFuncPtr) + 1;
+
 class Object {
 public:
     virtual ~Object() {}
     virtual ObjectKind kind() const = 0;
     virtual bool is_atom() const = 0;
     virtual std::string debug() const = 0;
+
+    // Appends the objects this one holds references to to `refs`.
+    virtual void references(std::vector<Object *> &refs) const {}
+
+    // Drops the references to other objects, to break a cycle. The object
+    // must not be used afterwards.
+    virtual void clear_references() {}
+};
+
+// Number of objects allocated by this thread.
+static thread_local unsigned long OBJECTS_ALLOCATED = 0;
+
+void record_allocation(ObjectKind kind, size_t bytes);
+void record_free(ObjectKind kind, size_t bytes);
+void charge_heap(size_t bytes);
+void credit_heap(size_t bytes);
+
+// Strings up to this length are stored inline.
+const size_t INLINE_STRING_CHARS = 15;
+// A node of std::list holds two links and a shared pointer.
+const size_t LIST_NODE_BYTES =
+    2 * sizeof(void *) + sizeof(std::shared_ptr<int>);
+
+// Bytes of the buffer of `string`, or 0 if it is stored inline.
+size_t string_buffer_bytes(const std::string &string) {
+    return string.capacity() > INLINE_STRING_CHARS ? string.capacity() + 1 : 0;
+}
+
+// Memory an object owns out of line, such as the buffer of a long string,
+// which counts against the heap budget of the thread until it is freed.
+class HeapCharge {
+private:
+    size_t bytes = 0;
+
+public:
+    HeapCharge() = default;
+    HeapCharge(const HeapCharge &) = delete;
+    HeapCharge &operator=(const HeapCharge &) = delete;
+
+    ~HeapCharge() { credit_heap(bytes); }
+
+    void charge(size_t bytes) {
+        charge_heap(bytes);
+        this->bytes += bytes;
+    }
+};
+
+// Allocates objects of type `O` together with the control block of their
+// shared pointer, and accounts for them under `O::KIND`.
+template <typename T, typename O>
+class ObjectAllocator {
+public:
+    using value_type = T;
+
+    ObjectAllocator() {}
+
+    template <typename U>
+    ObjectAllocator(const ObjectAllocator<U, O> &) {}
+
+    T *allocate(size_t n) {
+        record_allocation(O::KIND, n * sizeof(T));
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        record_free(O::KIND, n * sizeof(T));
+        ::operator delete(p);
+    }
+
+    template <typename U>
+    bool operator==(const ObjectAllocator<U, O> &) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const ObjectAllocator<U, O> &) const {
+        return false;
+    }
 };
 
+// Whether objects of `kind` can reference others, and so be in a cycle.
+constexpr bool is_container(ObjectKind kind) {
+    return kind != ObjectKind::T && kind != ObjectKind::NIL &&
+           kind != ObjectKind::Integer && kind != ObjectKind::Number &&
+           kind != ObjectKind::String && kind != ObjectKind::Symbol &&
+           kind != ObjectKind::FuncPtr;
+}
+
+// Whether containers are registered for the cycle detector.
+static bool TRACK_CONTAINERS = false;
+
+void track_container(const std::shared_ptr<Object> &obj);
+
+// Every object must be created by this so that allocation stats are exact.
+template <typename O, typename... Args>
+std::shared_ptr<O> make_object(Args &&...args) {
+    auto obj = std::allocate_shared<O>(ObjectAllocator<O, O>(),
+                                       std::forward<Args>(args)...);
+    if (is_container(O::KIND) && TRACK_CONTAINERS) {
+        track_container(obj);
+    }
+    return obj;
+}
+
+const char *kind_name(ObjectKind kind) {
+    switch (kind) {
+        case ObjectKind::List:
+            return "List";
+        case ObjectKind::T:
+            return "T";
+        case ObjectKind::NIL:
+            return "NIL";
+        case ObjectKind::Integer:
+            return "Integer";
+        case ObjectKind::Number:
+            return "Number";
+        case ObjectKind::String:
+            return "String";
+        case ObjectKind::Symbol:
+            return "Symbol";
+        case ObjectKind::Function:
+            return "Function";
+        case ObjectKind::FuncPtr:
+            return "FuncPtr";
+        case ObjectKind::PartiallyAppliedFunction:
+            return "PartiallyAppliedFunction";
+        case ObjectKind::PartiallyAppliedFuncPtr:
+            return "PartiallyAppliedFuncPtr";
+        case ObjectKind::Macro:
+            return "Macro";
+        case ObjectKind::Quoted:
+            return "Quoted";
+        case ObjectKind::BackQuoted:
+            return "BackQuoted";
+        case ObjectKind::Comma:
+            return "Comma";
+        case ObjectKind::CommaAtmark:
+            return "CommaAtmark";
+        default:
+            return "unknown";
+    }
+}
+
 class EnvException : public std::runtime_error {
 public:
-    EnvException(const std::string &msg) : std::runtime_error(msg) {}
+    EnvException(const std::string &msg) : std::runtime_error(msg) {
+        count_exception();
+    }
 };
 
 // This use `Object` and `FuncPtr` use this, so this must be placed between
 // `Object` and `FuncPtr`.
+//
+// Bindings are split into a frozen base layer, which copies of an environment
+// share, and a private overlay which takes the writes. So copying an
+// environment costs O(overlay) rather than O(bindings).
 class Env {
 private:
-    std::map<std::string, std::shared_ptr<Object>> symtable;
+    using SymTable =
+        std::unordered_map<std::string, std::shared_ptr<Object>>;
+
+    // Overlay size from which `compact` folds it into the base layer.
+    static const size_t COMPACT_THRESHOLD = 32;
+
+    std::shared_ptr<const SymTable> base;
+    SymTable overlay;
     std::shared_ptr<Env> outer;
 
+    // While a snapshot is active, the previous overlay entry of every symbol
+    // set, or nullptr if it had none.
+    std::vector<std::pair<std::string, std::shared_ptr<Object>>> journal;
+    int snapshots;
+
 public:
-    Env() { this->outer = nullptr; }
+    Env() : base(std::make_shared<SymTable>()), snapshots(0) {
+        this->outer = nullptr;
+    }
+
+    Env(std::shared_ptr<Env> outer)
+        : base(std::make_shared<SymTable>()), snapshots(0) {
+        this->outer = outer;
+    }
+
+    // A copy starts without snapshots of its own.
+    Env(const Env &other)
+        : base(other.base),
+          overlay(other.overlay),
+          outer(other.outer),
+          snapshots(0) {}
+
+    Env &operator=(const Env &other) {
+        base = other.base;
+        overlay = other.overlay;
+        outer = other.outer;
+        journal.clear();
+        snapshots = 0;
+        return *this;
+    }
 
-    Env(std::shared_ptr<Env> outer) { this->outer = outer; }
+    // Returns the value of `sym`, or nullptr if it's unbound. Callers which
+    // can handle a miss use this, since raising an exception costs
+    // microseconds.
+    const std::shared_ptr<Object> *find(const std::string &sym) const {
+        for (const Env *env = this; env != nullptr; env = env->outer.get()) {
+            auto it = env->overlay.find(sym);
+            if (it != env->overlay.end()) {
+                return &it->second;
+            }
+            auto base_it = env->base->find(sym);
+            if (base_it != env->base->end()) {
+                return &base_it->second;
+            }
+        }
+        return nullptr;
+    }
 
     std::shared_ptr<Object> get_obj(const std::string &sym) {
-        try {
-            return symtable.at(sym);
-        } catch (std::out_of_range &_) {
-            if (outer != nullptr) {
-                return outer->get_obj(sym);
+        auto value = find(sym);
+        if (value == nullptr) {
+            throw EnvException("no such symbol exist: " + sym);
+        }
+        return *value;
+    }
+
+    void set_obj(const std::string &sym, const std::shared_ptr<Object> obj) {
+        if (snapshots > 0) {
+            auto it = overlay.find(sym);
+            journal.emplace_back(sym,
+                                 it != overlay.end() ? it->second : nullptr);
+        }
+        overlay[sym] = obj;
+    }
+
+    // Calls `f` with the name and the value of every binding of this
+    // environment, not of outer ones, in no particular order.
+    template <typename F>
+    void for_each(F f) const {
+        for (const auto &binding : overlay) {
+            f(binding.first, binding.second);
+        }
+        for (const auto &binding : *base) {
+            if (overlay.find(binding.first) == overlay.end()) {
+                f(binding.first, binding.second);
+            }
+        }
+    }
+
+    // Number of bindings visible from this environment, counting shadowed
+    // ones of outer environments too.
+    size_t size() const {
+        size_t count = base->size();
+        for (const auto &binding : overlay) {
+            if (base->find(binding.first) == base->end()) {
+                count++;
+            }
+        }
+        return count + (outer != nullptr ? outer->size() : 0);
+    }
+
+    const std::shared_ptr<Env> &get_outer() const { return outer; }
+
+    // Folds the overlay into a new base layer once it has grown large, so
+    // that copies stay cheap. Must not be called while other threads use this
+    // environment or while a snapshot is active.
+    void compact() {
+        if (overlay.size() < COMPACT_THRESHOLD || snapshots > 0) {
+            return;
+        }
+        auto merged = std::make_shared<SymTable>(*base);
+        for (auto &binding : overlay) {
+            (*merged)[binding.first] = std::move(binding.second);
+        }
+        base = merged;
+        // Frees the buckets too, which copies of the environment would copy.
+        overlay = SymTable();
+    }
+
+    // Starts recording changes so that they can be undone in O(changes).
+    // Every snapshot must be ended by either `rollback` or `release` with the
+    // returned mark, innermost first.
+    size_t snapshot() {
+        snapshots++;
+        return journal.size();
+    }
+
+    // Undoes the changes made since the snapshot `mark` and ends it.
+    void rollback(size_t mark) {
+        while (journal.size() > mark) {
+            auto &entry = journal.back();
+            if (entry.second == nullptr) {
+                overlay.erase(entry.first);
             } else {
-                throw EnvException("no such symbol exist: " + sym);
+                overlay[entry.first] = std::move(entry.second);
             }
+            journal.pop_back();
         }
+        release(mark);
     }
 
-    void set_obj(const std::string &sym, const std::shared_ptr<Object> obj) {
-        symtable[sym] = obj;
+    // Ends the snapshot `mark`, keeping the changes made since.
+    void release(size_t mark) {
+        // Inner snapshots end first, so none can end below this mark.
+        assert(snapshots > 0 && mark <= journal.size());
+        if (--snapshots == 0) {
+            journal.clear();
+        }
     }
 };
 
+class List;
+
+// With `--deferred-free`, lists whose rest has at least this many cells only
+// they hold are freed on a background thread.
+static bool DEFERRED_FREE = false;
+const size_t DEFERRED_FREE_MIN_CELLS = 4096;
+// Set on the thread which frees deferred lists.
+static thread_local bool IS_FREER_THREAD = false;
+
+void defer_free(std::shared_ptr<List> list);
+bool heap_limited();
+
 // A list which has one value and maybe have rest.
 class List : public Object, public std::enable_shared_from_this<List> {
 private:
     std::shared_ptr<Object> value;
     std::shared_ptr<List> next;
 
+    // Whether `list` starts with at least `n` cells which are only held by
+    // the cell before them.
+    static bool owns_cells(const std::shared_ptr<List> &list, size_t n) {
+        const std::shared_ptr<List> *it = &list;
+        for (size_t i = 0; i < n; i++) {
+            if (*it == nullptr || it->use_count() != 1) {
+                return false;
+            }
+            it = &(*it)->next;
+        }
+        return true;
+    }
+
 public:
     List(std::shared_ptr<Object> value) {
         this->value = value;
@@ -309,6 +690,20 @@ public:
         this->next = next;
     }
 
+    // Unlinks the cells of the rest one by one, because destroying them
+    // recursively overflows the stack on long lists.
+    ~List() override {
+        if (DEFERRED_FREE && !IS_FREER_THREAD && !heap_limited() &&
+            owns_cells(next, DEFERRED_FREE_MIN_CELLS)) {
+            defer_free(std::move(next));
+            return;
+        }
+        while (next != nullptr && next.use_count() == 1) {
+            std::shared_ptr<List> rest = std::move(next->next);
+            next = std::move(rest);
+        }
+    }
+
     void append(std::shared_ptr<List> list) {
         auto it = shared_from_this();
         while (it->next != nullptr) {
@@ -318,7 +713,7 @@ public:
     }
 
     void insert(std::shared_ptr<Object> value) {
-        auto obj = std::make_shared<List>(value);
+        auto obj = make_object<List>(value);
         obj->next = next;
         next = obj;
     }
@@ -337,10 +732,28 @@ public:
 
     std::shared_ptr<List> get_next() { return next; }
 
-    ObjectKind kind() const override { return ObjectKind::List; }
+    void set_value(std::shared_ptr<Object> value) { this->value = value; }
+
+    void set_next(std::shared_ptr<List> next) { this->next = next; }
+
+    static const ObjectKind KIND = ObjectKind::List;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(value.get());
+        if (next != nullptr) {
+            refs.push_back(next.get());
+        }
+    }
+
+    void clear_references() override {
+        value = nullptr;
+        next = nullptr;
+    }
+
     std::string debug() const override {
         std::string s = "(";
         auto list = shared_from_this();
@@ -352,9 +765,55 @@ public:
     }
 };
 
+// Frees the lists it is given on a thread of its own, so that evaluation
+// doesn't wait for large frees.
+class DeferredFreer {
+private:
+    std::vector<std::shared_ptr<List>> lists;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool started;
+
+    void work() {
+        IS_FREER_THREAD = true;
+        while (true) {
+            std::vector<std::shared_ptr<List>> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !lists.empty(); });
+                batch.swap(lists);
+            }
+            // The lists are freed as `batch` goes out of scope.
+        }
+    }
+
+public:
+    DeferredFreer() : started(false) {}
+
+    void push(std::shared_ptr<List> list) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!started) {
+                std::thread([this] { work(); }).detach();
+                started = true;
+            }
+            lists.push_back(std::move(list));
+        }
+        cond.notify_one();
+    }
+};
+
+void defer_free(std::shared_ptr<List> list) {
+    // Never freed, as its thread runs until exit.
+    static DeferredFreer *freer = new DeferredFreer();
+    freer->push(std::move(list));
+}
+
 class T : public Object {
 public:
-    ObjectKind kind() const override { return ObjectKind::T; }
+    static const ObjectKind KIND = ObjectKind::T;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -363,7 +822,9 @@ public:
 
 class NIL : public Object {
 public:
-    ObjectKind kind() const override { return ObjectKind::NIL; }
+    static const ObjectKind KIND = ObjectKind::NIL;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -379,7 +840,9 @@ public:
 
     int get_integer() { return integer; }
 
-    ObjectKind kind() const override { return ObjectKind::Integer; }
+    static const ObjectKind KIND = ObjectKind::Integer;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -395,7 +858,9 @@ public:
 
     double get_number() { return number; }
 
-    ObjectKind kind() const override { return ObjectKind::Number; }
+    static const ObjectKind KIND = ObjectKind::Number;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -405,13 +870,19 @@ public:
 class String : public Object {
 private:
     std::string string;
+    HeapCharge buffer;
 
 public:
-    String(std::string string) { this->string = string; }
+    String(std::string string) {
+        this->string = string;
+        buffer.charge(string_buffer_bytes(this->string));
+    }
 
     std::string &get_string() { return string; }
 
-    ObjectKind kind() const override { return ObjectKind::String; }
+    static const ObjectKind KIND = ObjectKind::String;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -421,13 +892,19 @@ public:
 class Symbol : public Object {
 private:
     std::string symbol;
+    HeapCharge buffer;
 
 public:
-    Symbol(std::string symbol) { this->symbol = symbol; }
+    Symbol(std::string symbol) {
+        this->symbol = symbol;
+        buffer.charge(string_buffer_bytes(this->symbol));
+    }
 
     std::string &get_symbol() { return symbol; }
 
-    ObjectKind kind() const override { return ObjectKind::Symbol; }
+    static const ObjectKind KIND = ObjectKind::Symbol;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return true; }
 
@@ -439,21 +916,66 @@ private:
     std::list<std::shared_ptr<Symbol>> params;
     std::list<std::shared_ptr<Object>> body;
 
+    // Name of the symbol this was first bound to, if any.
+    const char *name;
+
+    // Result of the last purity analysis in the low bit, and the purity epoch
+    // it is valid in above it.
+    std::atomic<unsigned long> purity;
+
+    // Nodes of `params` and `body`.
+    HeapCharge nodes;
+
 public:
     Function(std::list<std::shared_ptr<Symbol>> params,
-             std::list<std::shared_ptr<Object>> body) {
+             std::list<std::shared_ptr<Object>> body)
+        : name(nullptr), purity(0) {
         this->params = params;
         this->body = body;
+        nodes.charge((params.size() + body.size()) * LIST_NODE_BYTES);
     }
 
     std::list<std::shared_ptr<Symbol>> &get_params() { return params; }
 
     std::list<std::shared_ptr<Object>> &get_body() { return body; }
 
-    ObjectKind kind() const override { return ObjectKind::Function; }
+    const char *get_name() const { return name; }
+
+    void set_name(const char *name) { this->name = name; }
+
+    bool get_cached_purity(unsigned long epoch, bool &result) const {
+        auto cached = purity.load(std::memory_order_relaxed);
+        if (cached >> 1 != epoch) {
+            return false;
+        }
+        result = cached & 1;
+        return true;
+    }
+
+    void cache_purity(unsigned long epoch, bool result) {
+        purity.store(epoch << 1 | result, std::memory_order_relaxed);
+    }
+
+    static const ObjectKind KIND = ObjectKind::Function;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        for (const auto &param : params) {
+            refs.push_back(param.get());
+        }
+        for (const auto &form : body) {
+            refs.push_back(form.get());
+        }
+    }
+
+    void clear_references() override {
+        params.clear();
+        body.clear();
+    }
+
     std::string debug() const override {
         std::ostringstream ss;
         ss << "FUNCTION (";
@@ -496,12 +1018,24 @@ public:
 
     std::shared_ptr<List> &get_args() { return args; }
 
-    ObjectKind kind() const override {
-        return ObjectKind::PartiallyAppliedFunction;
-    }
+    static const ObjectKind KIND = ObjectKind::PartiallyAppliedFunction;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(func.get());
+        if (args != nullptr) {
+            refs.push_back(args.get());
+        }
+    }
+
+    void clear_references() override {
+        func = nullptr;
+        args = nullptr;
+    }
+
     std::string debug() const override {
         std::string s = func->debug();
         auto arg_it = args;
@@ -513,24 +1047,58 @@ public:
     }
 };
 
+// How a buildin function behaves with respect to side effects. `Strict` ones
+// are pure and also evaluate every argument exactly once, so their arguments
+// can be evaluated before the call.
+enum class Purity {
+    Impure,
+    Pure,
+    Strict,
+};
+
 class FuncPtr : public Object {
 private:
     std::function<std::shared_ptr<Object>(const std::shared_ptr<List>, Env &)>
         func;
+    Purity purity;
+    const char *name;
+#ifdef MLISP_DISPATCH_STATS
+    std::atomic<uint64_t> calls;
+#endif
 
 public:
     FuncPtr(std::function<std::shared_ptr<Object>(const std::shared_ptr<List>,
                                                   Env &)>
-                func) {
+                func,
+            Purity purity = Purity::Impure) {
         this->func = func;
+        this->purity = purity;
+        this->name = nullptr;
+#ifdef MLISP_DISPATCH_STATS
+        this->calls = 0;
+#endif
     }
 
+#ifdef MLISP_DISPATCH_STATS
+    void count_call() { calls.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t get_calls() const { return calls.load(); }
+#endif
+
+    const char *get_name() const { return name; }
+
+    void set_name(const char *name) { this->name = name; }
+
     std::function<std::shared_ptr<Object>(const std::shared_ptr<List>, Env &)> &
     get_func() {
         return func;
     };
 
-    ObjectKind kind() const override { return ObjectKind::FuncPtr; }
+    Purity get_purity() const { return purity; }
+
+    static const ObjectKind KIND = ObjectKind::FuncPtr;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
@@ -558,12 +1126,24 @@ public:
 
     std::shared_ptr<List> get_args() { return args; }
 
-    ObjectKind kind() const override {
-        return ObjectKind::PartiallyAppliedFuncPtr;
-    }
+    static const ObjectKind KIND = ObjectKind::PartiallyAppliedFuncPtr;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(func.get());
+        if (args != nullptr) {
+            refs.push_back(args.get());
+        }
+    }
+
+    void clear_references() override {
+        func = nullptr;
+        args = nullptr;
+    }
+
     std::string debug() const override {
         return "partially applied buildin function";
     }
@@ -573,22 +1153,46 @@ class Macro : public Object {
 private:
     std::list<std::shared_ptr<Symbol>> params;
     std::list<std::shared_ptr<Object>> body;
+    const char *name;
+    HeapCharge nodes;
 
 public:
     Macro(std::list<std::shared_ptr<Symbol>> params,
           std::list<std::shared_ptr<Object>> body) {
         this->params = params;
         this->body = body;
+        this->name = nullptr;
+        nodes.charge((params.size() + body.size()) * LIST_NODE_BYTES);
     }
 
     std::list<std::shared_ptr<Symbol>> &get_params() { return params; }
 
     std::list<std::shared_ptr<Object>> &get_body() { return body; }
 
-    ObjectKind kind() const override { return ObjectKind::Macro; }
+    const char *get_name() const { return name; }
+
+    void set_name(const char *name) { this->name = name; }
+
+    static const ObjectKind KIND = ObjectKind::Macro;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        for (const auto &param : params) {
+            refs.push_back(param.get());
+        }
+        for (const auto &form : body) {
+            refs.push_back(form.get());
+        }
+    }
+
+    void clear_references() override {
+        params.clear();
+        body.clear();
+    }
+
     std::string debug() const override {
         std::ostringstream ss;
         ss << "MACRO (";
@@ -619,10 +1223,18 @@ public:
 
     std::shared_ptr<Object> get_object() { return object; }
 
-    ObjectKind kind() const override { return ObjectKind::Quoted; }
+    static const ObjectKind KIND = ObjectKind::Quoted;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(object.get());
+    }
+
+    void clear_references() override { object = nullptr; }
+
     std::string debug() const override { return "'" + object->debug(); }
 };
 
@@ -635,10 +1247,18 @@ public:
 
     std::shared_ptr<Object> get_object() { return object; }
 
-    ObjectKind kind() const override { return ObjectKind::BackQuoted; }
+    static const ObjectKind KIND = ObjectKind::BackQuoted;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(object.get());
+    }
+
+    void clear_references() override { object = nullptr; }
+
     std::string debug() const override { return "`" + object->debug(); }
 };
 
@@ -651,10 +1271,18 @@ public:
 
     std::shared_ptr<Object> get_object() { return object; }
 
-    ObjectKind kind() const override { return ObjectKind::Comma; }
+    static const ObjectKind KIND = ObjectKind::Comma;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(object.get());
+    }
+
+    void clear_references() override { object = nullptr; }
+
     std::string debug() const override { return "," + object->debug(); }
 };
 
@@ -667,1462 +1295,4393 @@ public:
 
     std::shared_ptr<Object> get_object() { return object; }
 
-    ObjectKind kind() const override { return ObjectKind::CommaAtmark; }
+    static const ObjectKind KIND = ObjectKind::CommaAtmark;
+
+    ObjectKind kind() const override { return KIND; }
 
     bool is_atom() const override { return false; }
 
+    void references(std::vector<Object *> &refs) const override {
+        refs.push_back(object.get());
+    }
+
+    void clear_references() override { object = nullptr; }
+
     std::string debug() const override { return ",@" + object->debug(); }
 };
 
-static std::shared_ptr<T> GLOBAL_T = std::make_shared<T>();
-static std::shared_ptr<NIL> GLOBAL_NIL = std::make_shared<NIL>();
+static std::shared_ptr<T> GLOBAL_T = make_object<T>();
+static std::shared_ptr<NIL> GLOBAL_NIL = make_object<NIL>();
+
+// Streams the buildins write to. Batch workers point these at buffers.
+static thread_local std::ostream *LISP_OUT = &std::cout;
+static thread_local std::ostream *LISP_ERR = &std::cerr;
+
+static bool AUTO_PARALLEL = false;
+// Threads of the auto parallelization pool.
+static const unsigned PARALLEL_WORKERS =
+    std::max(1u, std::thread::hardware_concurrency());
+static thread_local bool IN_PARALLEL_TASK = false;
+static std::atomic<unsigned long> PARALLEL_CALLS(0);
+
+// Bumped whenever `set` binds a callable object to a symbol, which
+// invalidates cached purity of functions calling it by name.
+static std::atomic<unsigned long> PURITY_EPOCH(1);
+
+// Callable arguments bound by a call are only visible to analyses on the
+// calling thread, so they move just that thread to a new epoch, without
+// touching shared memory. Threads take their epochs from disjoint blocks, so
+// purity cached by one thread is never valid on another.
+const unsigned long PURITY_EPOCH_BLOCK = 1ul << 20;
+static std::atomic<unsigned long> NEXT_PURITY_EPOCH_BLOCK(1);
+static thread_local unsigned long THREAD_PURITY_EPOCH = 0;
+static thread_local unsigned long SEEN_PURITY_EPOCH = 0;
+
+void take_purity_epoch_block() {
+    THREAD_PURITY_EPOCH =
+        NEXT_PURITY_EPOCH_BLOCK.fetch_add(1, std::memory_order_relaxed) *
+        PURITY_EPOCH_BLOCK;
+}
+
+void bump_thread_purity_epoch() {
+    if (++THREAD_PURITY_EPOCH % PURITY_EPOCH_BLOCK == 0) {
+        take_purity_epoch_block();
+    }
+}
+
+// The epoch purity is cached in by this thread, which changes with both
+// `set` anywhere and callable bindings on this thread.
+unsigned long purity_epoch() {
+    auto global = PURITY_EPOCH.load(std::memory_order_acquire);
+    if (global != SEEN_PURITY_EPOCH ||
+        THREAD_PURITY_EPOCH < PURITY_EPOCH_BLOCK) {
+        SEEN_PURITY_EPOCH = global;
+        take_purity_epoch_block();
+    }
+    return THREAD_PURITY_EPOCH;
+}
+
+bool is_callable(const std::shared_ptr<Object> &object) {
+    switch (object->kind()) {
+        case ObjectKind::Function:
+        case ObjectKind::FuncPtr:
+        case ObjectKind::PartiallyAppliedFunction:
+        case ObjectKind::PartiallyAppliedFuncPtr:
+        case ObjectKind::Macro:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Bumps the thread's purity epoch when a function call binds a callable
+// argument, and again when the call ends so the callee's bindings don't
+// outlive it.
+class CallableBindingGuard {
+private:
+    bool bound;
 
-class ParseException : public std::runtime_error {
 public:
-    ParseException(const std::string &msg) : std::runtime_error(msg) {}
+    CallableBindingGuard() : bound(false) {}
+
+    ~CallableBindingGuard() {
+        if (bound) {
+            bump_thread_purity_epoch();
+        }
+    }
+
+    void bind(const std::shared_ptr<Object> &value) {
+        if (is_callable(value)) {
+            bound = true;
+            bump_thread_purity_epoch();
+        }
+    }
 };
 
-std::vector<std::shared_ptr<Object>> parse(
-    const std::vector<std::shared_ptr<Token>> &tokens);
-std::shared_ptr<Object> parse_object(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Integer> parse_int(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Number> parse_num(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<String> parse_str(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Symbol> parse_sym(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Object> parse_list(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Quoted> parse_quote(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<BackQuoted> parse_back_quote(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<Comma> parse_comma(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
-std::shared_ptr<CommaAtmark> parse_comma_atmark(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+// Names of functions, interned so that profilers can keep plain pointers to
+// them after the functions are gone.
+struct InternTable {
+    std::mutex mutex;
+    std::unordered_set<std::string> names;
+};
 
-std::vector<std::shared_ptr<Object>> parse(
-    const std::vector<std::shared_ptr<Token>> &tokens) {
-    std::vector<std::shared_ptr<Object>> atoms = {};
-    auto it = tokens.begin();
-    const auto last = tokens.end();
-    while (it != tokens.end()) {
-        atoms.push_back(parse_object(it, last));
-    }
-    return atoms;
+InternTable &intern_table() {
+    static InternTable table;
+    return table;
 }
 
-std::shared_ptr<Object> parse_object(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    }
+const char *intern_name(const std::string &name) {
+    auto &table = intern_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return table.names.insert(name).first->c_str();
+}
 
-    switch ((*it)->kind()) {
-        case TokenKind::Integer:
-            return parse_int(it, last);
-        case TokenKind::Number:
-            return parse_num(it, last);
-        case TokenKind::String:
-            return parse_str(it, last);
-        case TokenKind::LParen:
-            return parse_list(it, last);
-        case TokenKind::Ident:
-            return parse_sym(it, last);
-        case TokenKind::Quote:
-            return parse_quote(it, last);
-        case TokenKind::BackQuote:
-            return parse_back_quote(it, last);
-        case TokenKind::Comma:
-            return parse_comma(it, last);
-        case TokenKind::CommaAtmark:
-            return parse_comma_atmark(it, last);
-        default:
-            std::ostringstream ss;
-            ss << "unexpected token " << (*it)->debug();
-            ss << " found: expect integer, number ( or identifier";
-            throw ParseException(ss.str());
-    }
+size_t interned_name_count() {
+    auto &table = intern_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return table.names.size();
 }
 
-std::shared_ptr<Integer> parse_int(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::Integer) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug()
-           << " found: expected integer";
-        throw ParseException(ss.str());
-    } else {
-        const std::shared_ptr<IntegerToken> integer =
-            std::static_pointer_cast<IntegerToken>(*it);
-        it++;
-        return std::make_shared<Integer>(integer->get_integer());
+// Names an unnamed function or macro after the symbol it is bound to.
+void name_callable(const std::shared_ptr<Object> &obj,
+                   const std::string &name) {
+    if (obj->kind() == ObjectKind::Function) {
+        auto func = std::static_pointer_cast<Function>(obj);
+        if (func->get_name() == nullptr) {
+            func->set_name(intern_name(name));
+        }
+    } else if (obj->kind() == ObjectKind::FuncPtr) {
+        auto func = std::static_pointer_cast<FuncPtr>(obj);
+        if (func->get_name() == nullptr) {
+            func->set_name(intern_name(name));
+        }
+    } else if (obj->kind() == ObjectKind::Macro) {
+        auto macro = std::static_pointer_cast<Macro>(obj);
+        if (macro->get_name() == nullptr) {
+            macro->set_name(intern_name(name));
+        }
     }
 }
 
-std::shared_ptr<Number> parse_num(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::Number) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug()
-           << " found: expected number";
-        throw ParseException(ss.str());
-    } else {
-        const std::shared_ptr<NumberToken> number =
-            std::static_pointer_cast<NumberToken>(*it);
-        it++;
-        return std::make_shared<Number>(number->get_number());
+// Sampling profiler.
+//
+// While enabled, every thread keeps a shadow stack of the names of the Lisp
+// functions it is applying. SIGPROF handler copies the stack of the thread it
+// interrupts into a preallocated buffer, which is folded into the format of
+// flamegraph tools at the end.
+
+const int SHADOW_STACK_DEPTH = 256;
+
+struct ShadowStack {
+    const char *frames[SHADOW_STACK_DEPTH];
+    // May exceed SHADOW_STACK_DEPTH, in which case the deepest frames are
+    // not recorded.
+    volatile int depth;
+};
+
+static thread_local ShadowStack SHADOW_STACK;
+
+// Per call instrumentations which are enabled. They are checked once per call
+// so that they cost next to nothing when disabled.
+enum Instrumentation : unsigned {
+    INSTRUMENT_SHADOW_STACK = 1 << 0,
+    INSTRUMENT_CALL_PROFILE = 1 << 1,
+};
+
+static std::atomic<unsigned> INSTRUMENTATION(0);
+
+// Each sample is stored as its depth followed by its frames, outermost first.
+const size_t PROFILE_BUFFER_SIZE = 1 << 22;
+
+static uintptr_t *PROFILE_BUFFER = nullptr;
+// End of the samples written, which only ever covers whole samples.
+static std::atomic<size_t> PROFILE_BUFFER_USED(0);
+static std::atomic<size_t> PROFILE_SAMPLES_DROPPED(0);
+
+void on_sigprof(int) {
+    auto &stack = SHADOW_STACK;
+    int stack_depth = stack.depth;
+    size_t depth = std::min(stack_depth, SHADOW_STACK_DEPTH);
+    std::atomic_signal_fence(std::memory_order_acquire);
+    // Samples of several threads may be taken at once, so space is reserved
+    // with a CAS which fails rather than claiming space past the end.
+    size_t pos = PROFILE_BUFFER_USED.load(std::memory_order_relaxed);
+    do {
+        if (pos + depth + 1 > PROFILE_BUFFER_SIZE) {
+            PROFILE_SAMPLES_DROPPED.fetch_add(1);
+            return;
+        }
+    } while (!PROFILE_BUFFER_USED.compare_exchange_weak(pos, pos + depth + 1));
+    PROFILE_BUFFER[pos] = depth;
+    for (size_t i = 0; i < depth; i++) {
+        PROFILE_BUFFER[pos + 1 + i] =
+            reinterpret_cast<uintptr_t>(stack.frames[i]);
     }
 }
 
-std::shared_ptr<String> parse_str(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::String) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug()
-           << " found: expected string";
-        throw ParseException(ss.str());
-    } else {
-        const std::shared_ptr<StringToken> string =
-            std::static_pointer_cast<StringToken>(*it);
-        it++;
-        return std::make_shared<String>(string->get_string());
+void start_sampling_profiler(int interval_us) {
+    PROFILE_BUFFER = new uintptr_t[PROFILE_BUFFER_SIZE];
+    INSTRUMENTATION |= INSTRUMENT_SHADOW_STACK;
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+
+    itimerval timer = {};
+    timer.it_interval.tv_usec = interval_us;
+    timer.it_value.tv_usec = interval_us;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+// Stops sampling and writes the samples to `path` in folded stack format.
+void stop_sampling_profiler(const std::string &path) {
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+
+    std::map<std::string, size_t> stacks;
+    size_t used = PROFILE_BUFFER_USED.load();
+    size_t pos = 0;
+    while (pos < used) {
+        size_t depth = PROFILE_BUFFER[pos++];
+        std::string stack = "mlisp";
+        for (size_t i = 0; i < depth; i++) {
+            stack += ";";
+            stack += reinterpret_cast<const char *>(PROFILE_BUFFER[pos + i]);
+        }
+        stacks[stack]++;
+        pos += depth;
+    }
+
+    std::ofstream ofs(path);
+    if (!ofs) {
+        std::cerr << "faild to open file " << path << std::endl;
+        return;
+    }
+    for (const auto &stack : stacks) {
+        ofs << stack.first << " " << stack.second << "\n";
+    }
+    if (PROFILE_SAMPLES_DROPPED > 0) {
+        std::cerr << "profile buffer is full: dropped "
+                  << PROFILE_SAMPLES_DROPPED << " samples" << std::endl;
     }
 }
 
-std::shared_ptr<Symbol> parse_sym(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::Ident) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug()
-           << " found: expected identifier";
-        throw ParseException(ss.str());
-    } else {
-        const std::shared_ptr<IdentToken> ident =
-            std::static_pointer_cast<IdentToken>(*it);
-        it++;
-        return std::make_shared<Symbol>(ident->get_ident());
+// Deterministic call profiler.
+//
+// Records the calls, the inclusive and exclusive time and the objects
+// allocated of every function applied while enabled. Each thread profiles
+// into its own table.
+
+struct CallStats {
+    unsigned long calls = 0;
+    uint64_t inclusive_ns = 0;
+    uint64_t exclusive_ns = 0;
+    unsigned long allocations = 0;
+    // Activations on the stack. Only the outermost one of a recursive
+    // function adds to its inclusive time.
+    int active = 0;
+};
+
+using CallProfile = std::unordered_map<const char *, CallStats>;
+
+void merge_call_profile(CallProfile &into, const CallProfile &from) {
+    for (const auto &entry : from) {
+        auto &stats = into[entry.first];
+        stats.calls += entry.second.calls;
+        stats.inclusive_ns += entry.second.inclusive_ns;
+        stats.exclusive_ns += entry.second.exclusive_ns;
+        stats.allocations += entry.second.allocations;
     }
 }
 
-std::shared_ptr<Object> parse_list(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::LParen) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug() << " found: expected (";
-        throw ParseException(ss.str());
-    } else {
-        it++;
+class CallProfiler {
+private:
+    struct Frame {
+        CallStats *stats;
+        std::chrono::steady_clock::time_point start;
+        uint64_t children_ns;
+        unsigned long allocations_start;
+        unsigned long children_allocations;
+    };
+
+    static std::mutex mutex;
+    static std::set<CallProfiler *> profilers;
+    static CallProfile retired;
+
+    CallProfile profile;
+    std::vector<Frame> frames;
+
+public:
+    CallProfiler() {
+        std::lock_guard<std::mutex> lock(mutex);
+        profilers.insert(this);
     }
 
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() == TokenKind::RParen) {
-        it++;
-        return GLOBAL_NIL;
-    } else {
-        std::shared_ptr<List> list =
-            std::make_shared<List>(parse_object(it, last));
-        while (true) {
-            if (it == last) {
-                throw ParseException("expected token, but not found");
-            } else if ((*it)->kind() == TokenKind::RParen) {
-                it++;
-                break;
-            } else {
-                list->append(std::make_shared<List>(parse_object(it, last)));
+    ~CallProfiler() {
+        std::lock_guard<std::mutex> lock(mutex);
+        profilers.erase(this);
+        merge_call_profile(retired, profile);
+    }
+
+    void enter(const char *name) {
+        auto &stats = profile[name];
+        stats.calls++;
+        stats.active++;
+        frames.push_back(Frame{&stats, std::chrono::steady_clock::now(), 0,
+                               OBJECTS_ALLOCATED, 0});
+    }
+
+    void leave() {
+        auto frame = frames.back();
+        frames.pop_back();
+        uint64_t elapsed =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - frame.start)
+                .count();
+        unsigned long allocations =
+            OBJECTS_ALLOCATED - frame.allocations_start;
+        frame.stats->exclusive_ns += elapsed - frame.children_ns;
+        frame.stats->allocations += allocations - frame.children_allocations;
+        if (--frame.stats->active == 0) {
+            frame.stats->inclusive_ns += elapsed;
+        }
+        if (!frames.empty()) {
+            frames.back().children_ns += elapsed;
+            frames.back().children_allocations += allocations;
+        }
+    }
+
+    // Swaps the table being recorded into. Open frames keep pointing at their
+    // entries, which swapping leaves in place.
+    void swap_profile(CallProfile &other) { profile.swap(other); }
+
+    // Adds the profile of a nested `with-profiling` to this one. The time of
+    // functions which are active here is already covered by their open
+    // frames, so it isn't added to their inclusive time again.
+    void merge_nested_profile(const CallProfile &nested) {
+        for (const auto &entry : nested) {
+            auto &stats = profile[entry.first];
+            stats.calls += entry.second.calls;
+            if (stats.active == 0) {
+                stats.inclusive_ns += entry.second.inclusive_ns;
             }
+            stats.exclusive_ns += entry.second.exclusive_ns;
+            stats.allocations += entry.second.allocations;
         }
-        return list;
     }
+
+    // Profile of every thread so far. Only meaningful while other threads
+    // aren't evaluating.
+    static CallProfile collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        CallProfile all = retired;
+        for (auto profiler : profilers) {
+            merge_call_profile(all, profiler->profile);
+        }
+        return all;
+    }
+};
+
+std::mutex CallProfiler::mutex;
+std::set<CallProfiler *> CallProfiler::profilers;
+CallProfile CallProfiler::retired;
+
+static thread_local CallProfiler CALL_PROFILER;
+
+// Entries of `profile` by decreasing exclusive time.
+std::vector<std::pair<const char *, CallStats>> sort_call_profile(
+    const CallProfile &profile) {
+    std::vector<std::pair<const char *, CallStats>> entries(profile.begin(),
+                                                            profile.end());
+    std::sort(entries.begin(), entries.end(),
+              [](const std::pair<const char *, CallStats> &l,
+                 const std::pair<const char *, CallStats> &r) {
+                  return l.second.exclusive_ns > r.second.exclusive_ns;
+              });
+    return entries;
 }
 
-std::shared_ptr<Quoted> parse_quote(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::Quote) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug() << " found: expected '";
-        throw ParseException(ss.str());
-    } else {
-        it++;
-        return std::make_shared<Quoted>(parse_object(it, last));
+void print_call_profile(std::ostream &os, const CallProfile &profile) {
+    char line[256];
+    std::snprintf(line, sizeof(line), "%10s %12s %12s %12s  %s\n", "calls",
+                  "incl(ms)", "excl(ms)", "allocs", "function");
+    os << line;
+    for (const auto &entry : sort_call_profile(profile)) {
+        std::snprintf(line, sizeof(line), "%10lu %12.3f %12.3f %12lu  %s\n",
+                      entry.second.calls, entry.second.inclusive_ns / 1e6,
+                      entry.second.exclusive_ns / 1e6,
+                      entry.second.allocations, entry.first);
+        os << line;
     }
 }
 
-std::shared_ptr<BackQuoted> parse_back_quote(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::BackQuote) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug() << " found: expected `";
-        throw ParseException(ss.str());
-    } else {
-        it++;
-        return std::make_shared<BackQuoted>(parse_object(it, last));
+// Counters which are always on.
+//
+// Each thread counts into its own counters. Only the owning thread writes
+// them, so that counting needs no locked instructions, but any thread may
+// read them.
+
+struct ThreadCounters {
+    std::atomic<uint64_t> allocated[OBJECT_KIND_COUNT];
+    std::atomic<uint64_t> allocated_bytes[OBJECT_KIND_COUNT];
+    std::atomic<uint64_t> freed[OBJECT_KIND_COUNT];
+    std::atomic<uint64_t> freed_bytes[OBJECT_KIND_COUNT];
+    std::atomic<uint64_t> eval_steps;
+    // Applications of functions, buildins and macros.
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> macro_expansions;
+    std::atomic<uint64_t> exceptions;
+};
+
+inline void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+static std::mutex THREAD_COUNTERS_MUTEX;
+static thread_local ThreadCounters *THREAD_COUNTERS = nullptr;
+
+// Counters of every thread. Neither they nor this are ever freed, so that
+// objects may be counted during static initialization and destruction.
+std::vector<ThreadCounters *> &all_thread_counters() {
+    static auto all = new std::vector<ThreadCounters *>();
+    return *all;
+}
+
+ThreadCounters &thread_counters() {
+    if (THREAD_COUNTERS == nullptr) {
+        THREAD_COUNTERS = new ThreadCounters();
+        std::lock_guard<std::mutex> lock(THREAD_COUNTERS_MUTEX);
+        all_thread_counters().push_back(THREAD_COUNTERS);
     }
+    return *THREAD_COUNTERS;
 }
 
-std::shared_ptr<Comma> parse_comma(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::Comma) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug() << " found: expected ,";
-        throw ParseException(ss.str());
-    } else {
-        it++;
-        return std::make_shared<Comma>(parse_object(it, last));
+void add_counters(ThreadCounters &into, const ThreadCounters &counters) {
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        bump(into.allocated[i], counters.allocated[i]);
+        bump(into.allocated_bytes[i], counters.allocated_bytes[i]);
+        bump(into.freed[i], counters.freed[i]);
+        bump(into.freed_bytes[i], counters.freed_bytes[i]);
     }
+    bump(into.eval_steps, counters.eval_steps);
+    bump(into.calls, counters.calls);
+    bump(into.macro_expansions, counters.macro_expansions);
+    bump(into.exceptions, counters.exceptions);
 }
 
-std::shared_ptr<CommaAtmark> parse_comma_atmark(
-    std::vector<std::shared_ptr<Token>>::const_iterator &it,
-    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
-    if (it == last) {
-        throw ParseException("expected token, but not found");
-    } else if ((*it)->kind() != TokenKind::CommaAtmark) {
-        std::ostringstream ss;
-        ss << "unexpected token " << (*it)->debug() << " found: expected ,@";
-        throw ParseException(ss.str());
-    } else {
-        it++;
-        return std::make_shared<CommaAtmark>(parse_object(it, last));
+// Sums the counters of every thread into `into`.
+void collect_counters(ThreadCounters &into) {
+    std::lock_guard<std::mutex> lock(THREAD_COUNTERS_MUTEX);
+    for (auto counters : all_thread_counters()) {
+        add_counters(into, *counters);
     }
 }
 
-class EvalException : public std::runtime_error {
+void count_exception() { bump(thread_counters().exceptions); }
+
+uint64_t total_allocated(const ThreadCounters &counters, bool bytes) {
+    uint64_t total = 0;
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        total += bytes ? counters.allocated_bytes[i] : counters.allocated[i];
+    }
+    return total;
+}
+
+// Allocation profiler.
+//
+// While sampling is enabled, 1 in ALLOC_SAMPLE_RATE allocations is attributed
+// to the function on the top of the shadow stack.
+
+struct AllocSite {
+    uint64_t objects = 0;
+    uint64_t bytes = 0;
+};
+
+// 0 disables sampling.
+static long ALLOC_SAMPLE_RATE = 0;
+static thread_local long ALLOC_SAMPLE_COUNTDOWN = 0;
+static std::mutex ALLOC_SITES_MUTEX;
+static std::map<std::pair<const char *, ObjectKind>, AllocSite> ALLOC_SITES;
+
+void sample_allocation(ObjectKind kind, size_t bytes) {
+    auto &stack = SHADOW_STACK;
+    int stack_depth = stack.depth;
+    int depth = std::min(stack_depth, SHADOW_STACK_DEPTH);
+    const char *site = depth > 0 ? stack.frames[depth - 1] : "toplevel";
+    std::lock_guard<std::mutex> lock(ALLOC_SITES_MUTEX);
+    auto &stats = ALLOC_SITES[std::make_pair(site, kind)];
+    stats.objects += ALLOC_SAMPLE_RATE;
+    stats.bytes += bytes * ALLOC_SAMPLE_RATE;
+}
+
+// Heap budget.
+//
+// Each thread counts the bytes of the objects it allocated less those it
+// freed. An allocation which would take that over the limit of the thread
+// fails with an EvalException, which unwinds like any other error.
+
+static thread_local int64_t HEAP_IN_USE = 0;
+static thread_local int64_t HEAP_LIMIT = INT64_MAX;
+// Bytes of objects each script, request or interpreter session may add, or
+// 0 for no limit.
+static int64_t MAX_HEAP_BYTES = 0;
+
+[[noreturn]] void heap_limit_exceeded();
+
+// Limits this thread to allocating `bytes` more than it frees while this
+// lives. Limits only ever get stricter when nested.
+class HeapBudget {
+private:
+    int64_t saved;
+
 public:
-    EvalException(const std::string &msg) : std::runtime_error(msg) {}
+    HeapBudget(int64_t bytes) : saved(HEAP_LIMIT) {
+        HEAP_LIMIT = std::min(saved, HEAP_IN_USE + bytes);
+    }
+
+    ~HeapBudget() { HEAP_LIMIT = saved; }
 };
 
-#define TAKE_JUST_ONE_ARG(name, args, a1)                                      \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-        if (args->get_next() != nullptr) {                                     \
-            throw EvalException("too many arguments for " +                    \
-                                std::string(name));                            \
-        }                                                                      \
-    } while (0)
+// Whether this thread has a heap budget. Its lists are then freed in place
+// rather than deferred, as the freer thread would credit them to itself.
+bool heap_limited() { return HEAP_LIMIT != INT64_MAX; }
 
-#define TAKE_JUST_TWO_ARG(name, args, a1, a2)                                  \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-        if (args->get_next() == nullptr) {                                     \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a2 = args->get_next()->get_value();                                    \
-        if (args->get_next()->get_next() != nullptr) {                         \
-            throw EvalException("too many arguments for " +                    \
-                                std::string(name));                            \
-        }                                                                      \
-    } while (0)
+void record_allocation(ObjectKind kind, size_t bytes) {
+    if (HEAP_IN_USE + static_cast<int64_t>(bytes) > HEAP_LIMIT) {
+        heap_limit_exceeded();
+    }
+    HEAP_IN_USE += bytes;
+    auto &counters = thread_counters();
+    bump(counters.allocated[static_cast<int>(kind)]);
+    bump(counters.allocated_bytes[static_cast<int>(kind)], bytes);
+    OBJECTS_ALLOCATED++;
+    MLISP_PROBE2(object__alloc, kind_name(kind), bytes);
+    if (ALLOC_SAMPLE_RATE != 0 && --ALLOC_SAMPLE_COUNTDOWN <= 0) {
+        ALLOC_SAMPLE_COUNTDOWN = ALLOC_SAMPLE_RATE;
+        sample_allocation(kind, bytes);
+    }
+}
 
-#define TAKE_JUST_THREE_ARG(name, args, a1, a2, a3)                            \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-        if (args->get_next() == nullptr) {                                     \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a2 = args->get_next()->get_value();                                    \
-        if (args->get_next()->get_next() == nullptr) {                         \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a3 = args->get_next()->get_next()->get_value();                        \
-        if (args->get_next()->get_next()->get_next() != nullptr) {             \
-            throw EvalException("too many arguments for " +                    \
-                                std::string(name));                            \
-        }                                                                      \
-    } while (0)
+void record_free(ObjectKind kind, size_t bytes) {
+    HEAP_IN_USE -= bytes;
+    auto &counters = thread_counters();
+    bump(counters.freed[static_cast<int>(kind)]);
+    bump(counters.freed_bytes[static_cast<int>(kind)], bytes);
+}
 
-#define EVAL_JUST_ONE_ARG(name, args, env, a1) \
-    do {                                       \
-        TAKE_JUST_ONE_ARG(name, args, a1);     \
-        a1 = eval(a1, env);                    \
-    } while (0)
+// Counts `bytes` an object owns out of line against the heap budget.
+void charge_heap(size_t bytes) {
+    if (HEAP_IN_USE + static_cast<int64_t>(bytes) > HEAP_LIMIT) {
+        heap_limit_exceeded();
+    }
+    HEAP_IN_USE += bytes;
+}
 
-#define EVAL_JUST_TWO_ARG(name, args, env, a1, a2) \
-    do {                                           \
-        TAKE_JUST_TWO_ARG(name, args, a1, a2);     \
-        a1 = eval(a1, env);                        \
-        a2 = eval(a2, env);                        \
-    } while (0)
+void credit_heap(size_t bytes) { HEAP_IN_USE -= bytes; }
+
+// Prints allocated and live objects and bytes by kind.
+void print_kind_stats(std::ostream &os, const ThreadCounters &counters) {
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-26s %12s %14s %10s %12s\n", "kind",
+                  "allocated", "bytes", "live", "live bytes");
+    os << line;
+    uint64_t totals[4] = {};
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        uint64_t values[4] = {
+            counters.allocated[i], counters.allocated_bytes[i],
+            counters.allocated[i] - counters.freed[i],
+            counters.allocated_bytes[i] - counters.freed_bytes[i]};
+        if (values[0] == 0) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) {
+            totals[j] += values[j];
+        }
+        std::snprintf(line, sizeof(line),
+                      "%-26s %12lu %14lu %10lu %12lu\n",
+                      kind_name(static_cast<ObjectKind>(i)), values[0],
+                      values[1], values[2], values[3]);
+        os << line;
+    }
+    std::snprintf(line, sizeof(line), "%-26s %12lu %14lu %10lu %12lu\n",
+                  "total", totals[0], totals[1], totals[2], totals[3]);
+    os << line;
+}
 
-#define EVAL_JUST_THREE_ARG(name, args, env, a1, a2, a3) \
-    do {                                                 \
-        TAKE_JUST_THREE_ARG(name, args, a1, a2, a3);     \
-        a1 = eval(a1, env);                              \
-        a2 = eval(a2, env);                              \
-        a3 = eval(a3, env);                              \
-    } while (0)
+// Prints the stats by kind, and the sampled sites by decreasing bytes.
+void print_alloc_stats(std::ostream &os) {
+    ThreadCounters counters{};
+    collect_counters(counters);
+    print_kind_stats(os, counters);
 
-#define TAKE_ONE_ARG(name, args, a1)                                           \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-    } while (0)
+    char line[256];
+    if (ALLOC_SAMPLE_RATE == 0) {
+        return;
+    }
+    std::vector<std::pair<std::pair<const char *, ObjectKind>, AllocSite>>
+        sites;
+    {
+        std::lock_guard<std::mutex> lock(ALLOC_SITES_MUTEX);
+        sites.assign(ALLOC_SITES.begin(), ALLOC_SITES.end());
+    }
+    std::sort(sites.begin(), sites.end(),
+              [](const std::pair<std::pair<const char *, ObjectKind>,
+                                 AllocSite> &l,
+                 const std::pair<std::pair<const char *, ObjectKind>,
+                                 AllocSite> &r) {
+                  return l.second.bytes > r.second.bytes;
+              });
+    os << "\nallocations by function (sampled 1 in " << ALLOC_SAMPLE_RATE
+       << ")\n";
+    std::snprintf(line, sizeof(line), "%12s %14s  %-26s %s\n", "objects",
+                  "bytes", "kind", "function");
+    os << line;
+    for (const auto &site : sites) {
+        std::snprintf(line, sizeof(line), "%12lu %14lu  %-26s %s\n",
+                      site.second.objects, site.second.bytes,
+                      kind_name(site.first.second), site.first.first);
+        os << line;
+    }
+}
 
-#define TAKE_TWO_ARG(name, args, a1, a2)                                       \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-        if (args->get_next() == nullptr) {                                     \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a2 = args->get_next()->get_value();                                    \
-    } while (0)
+// Hardware performance counters.
+//
+// Counts cycles, instructions and misses of the calling thread with
+// perf_event_open. Counters the kernel or the machine doesn't provide, as is
+// common in containers and virtual machines, are reported as unavailable.
 
-#define TAKE_THREE_ARG(name, args, a1, a2, a3)                                 \
-    do {                                                                       \
-        if (args == nullptr) {                                                 \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a1 = args->get_value();                                                \
-        if (args->get_next() == nullptr) {                                     \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a2 = args->get_next()->get_value();                                    \
-        if (args->get_next()->get_next() == nullptr) {                         \
-            throw EvalException("too few arguments for " + std::string(name)); \
-        }                                                                      \
-        a3 = args->get_next()->get_next()->get_value();                        \
-    } while (0)
+struct HardwareCounter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
 
-#define EVAL_ONE_ARG(name, args, env, a1) \
-    do {                                  \
-        TAKE_ONE_ARG(name, args, a1);     \
-        a1 = eval(a1, env);               \
-    } while (0)
+const uint64_t CACHE_READ_MISS = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+const HardwareCounter HARDWARE_COUNTERS[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | CACHE_READ_MISS},
+    {"LLC misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | CACHE_READ_MISS},
+    {"dTLB misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | CACHE_READ_MISS},
+};
 
-#define EVAL_TWO_ARG(name, args, env, a1, a2) \
-    do {                                      \
-        TAKE_TWO_ARG(name, args, a1, a2);     \
-        a1 = eval(a1, env);                   \
-        a2 = eval(a2, env);                   \
-    } while (0)
+const int HARDWARE_COUNTER_COUNT =
+    sizeof(HARDWARE_COUNTERS) / sizeof(HARDWARE_COUNTERS[0]);
 
-#define EVAL_THREE_ARG(name, args, env, a1, a2, a3) \
-    do {                                            \
-        TAKE_THREE_ARG(name, args, a1, a2, a3);     \
-        a1 = eval(a1, env);                         \
-        a2 = eval(a2, env);                         \
-        a3 = eval(a3, env);                         \
-    } while (0)
+class PerfCounters {
+private:
+    int fds[HARDWARE_COUNTER_COUNT];
+    // Why the first counter which couldn't be opened wasn't.
+    int open_errno;
+    ThreadCounters counters_before;
+    std::chrono::steady_clock::time_point start_time;
 
-std::shared_ptr<Object> eval(const std::shared_ptr<Object> &object, Env &env);
-std::shared_ptr<Object> eval_backquoted(const std::shared_ptr<Object> &object,
-                                        Env &env);
-std::shared_ptr<Object> eval_backquoted_list(const std::shared_ptr<List> &list,
-                                             Env &env);
-std::list<std::shared_ptr<Object>> eval_backquoted_inner(
-    const std::shared_ptr<Object> &object, Env &env);
-std::shared_ptr<Object> eval_list(const std::shared_ptr<List> &list, Env &env);
-std::shared_ptr<Object> eval_symbol(const std::shared_ptr<Symbol> &symbol,
-                                    Env &env);
-void assign_macro_sym(
-    std::list<std::shared_ptr<Symbol>>::iterator &sym_it,
-    const std::list<std::shared_ptr<Symbol>>::iterator &sym_last,
-    std::list<std::shared_ptr<Object>>::iterator &arg_it,
-    const std::list<std::shared_ptr<Object>>::iterator &arg_last, Env &env);
-std::list<std::shared_ptr<Object>> expand_macro(
-    const std::shared_ptr<Macro> macro, const std::shared_ptr<List> args,
-    Env &env);
-std::shared_ptr<Object> apply_macro(const std::shared_ptr<Macro> macro,
-                                    const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> apply_part_func_ptr(
-    const std::shared_ptr<PartiallyAppliedFuncPtr> func,
-    const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> apply_func_ptr(const std::shared_ptr<FuncPtr> func,
-                                       const std::shared_ptr<List> args,
-                                       Env &env);
-std::shared_ptr<Object> apply_part_func(
-    const std::shared_ptr<PartiallyAppliedFunction> func,
-    const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> apply_func(const std::shared_ptr<Function> func,
-                                   const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_quote(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_list(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_car(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_cdr(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_cons(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_atom(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_if(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_eq_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_ne_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_lt_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_gt_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_le_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_ge_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_add_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_sub_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_mul_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_div_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_string_nth(const std::shared_ptr<List> args,
-                                      Env &env);
-std::shared_ptr<Object> fn_eq_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_ne_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_lt_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_gt_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_le_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_ge_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_equal_str(const std::shared_ptr<List> args,
-                                     Env &env);
-std::shared_ptr<Object> fn_write(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_write_line(const std::shared_ptr<List> args,
-                                      Env &env);
-std::shared_ptr<Object> fn_print(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_prin1(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_princ(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_read_str(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_read_int(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_read_num(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_lambda(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_macro(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_set(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_int_to_string(const std::shared_ptr<List> args,
-                                         Env &env);
-std::shared_ptr<Object> fn_num_to_string(const std::shared_ptr<List> args,
-                                         Env &env);
-std::shared_ptr<Object> fn_debug(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_type_of(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_concat(const std::shared_ptr<List> args, Env &env);
-std::shared_ptr<Object> fn_macroexpand(const std::shared_ptr<List> args,
-                                       Env &env);
+public:
+    PerfCounters() : open_errno(0), counters_before{} {
+        for (int i = 0; i < HARDWARE_COUNTER_COUNT; i++) {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = HARDWARE_COUNTERS[i].type;
+            attr.config = HARDWARE_COUNTERS[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // Counters are multiplexed when there are more than the PMU has.
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] < 0 && open_errno == 0) {
+                open_errno = errno;
+            }
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    void start() {
+        collect_counters(counters_before);
+        start_time = std::chrono::steady_clock::now();
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    // Prints the counts since `start`, with IPC and the misses per eval step.
+    void report(std::ostream &os) {
+        double elapsed_ms = std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - start_time)
+                                .count();
+        ThreadCounters counters_after{};
+        collect_counters(counters_after);
+        uint64_t steps = counters_after.eval_steps - counters_before.eval_steps;
+
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "real time: %.3f ms\neval steps: %lu\n", elapsed_ms,
+                      steps);
+        os << line;
+        if (open_errno != 0) {
+            bool any = std::any_of(fds, fds + HARDWARE_COUNTER_COUNT,
+                                   [](int fd) { return fd >= 0; });
+            os << (any ? "some hardware counters are unavailable: "
+                       : "hardware counters are unavailable: ")
+               << std::strerror(open_errno) << "\n";
+        }
+
+        double values[HARDWARE_COUNTER_COUNT];
+        for (int i = 0; i < HARDWARE_COUNTER_COUNT; i++) {
+            // Value, time enabled and time running.
+            uint64_t data[3];
+            if (fds[i] < 0 ||
+                read(fds[i], data, sizeof(data)) != sizeof(data)) {
+                values[i] = -1;
+                continue;
+            }
+            // Scale up for the time the counter wasn't scheduled.
+            values[i] = data[2] > 0 ? data[0] * (double(data[1]) / data[2]) : 0;
+            std::snprintf(line, sizeof(line), "%s: %.0f (%.3f per eval step)\n",
+                          HARDWARE_COUNTERS[i].name, values[i],
+                          steps > 0 ? values[i] / steps : 0.0);
+            os << line;
+        }
+        if (values[0] > 0 && values[1] >= 0) {
+            std::snprintf(line, sizeof(line), "IPC: %.3f\n",
+                          values[1] / values[0]);
+            os << line;
+        }
+        os << std::flush;
+    }
+};
+
+// Trace events.
+//
+// While tracing, spans of the phases of evaluation are written to a file in
+// the Chrome trace event format, which chrome://tracing and Perfetto read.
+// Each thread records into a fixed size buffer of its own, which is written
+// out in one go when it fills up, so recording a span takes no lock.
+
+struct TraceEvent {
+    const char *name;
+    char detail[64];
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+const size_t TRACE_BUFFER_EVENTS = 4096;
+
+static std::mutex TRACE_MUTEX;
+static FILE *TRACE_FILE = nullptr;
+static std::string TRACE_PATH;
+static bool TRACE_FIRST_EVENT = true;
+static std::atomic<bool> TRACING(false);
+static std::chrono::steady_clock::time_point TRACE_START;
+// Calls of functions shorter than this aren't traced. Negative disables
+// tracing calls.
+static long TRACE_CALL_THRESHOLD_NS = -1;
+
+void write_json_string(FILE *file, const char *s) {
+    std::fputc('"', file);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            std::fputc('\\', file);
+            std::fputc(c, file);
+        } else if (c < 0x20) {
+            std::fprintf(file, "\\u%04x", c);
+        } else {
+            std::fputc(c, file);
+        }
+    }
+    std::fputc('"', file);
+}
+
+class TraceBuffer {
+private:
+    static std::set<TraceBuffer *> buffers;
+
+    std::vector<TraceEvent> events;
+    int tid;
+
+    // Must be called with TRACE_MUTEX held.
+    void write_locked() {
+        if (TRACE_FILE != nullptr) {
+            for (const auto &event : events) {
+                std::fputs(TRACE_FIRST_EVENT ? "" : ",\n", TRACE_FILE);
+                TRACE_FIRST_EVENT = false;
+                std::fprintf(TRACE_FILE,
+                             "{\"name\":\"%s\",\"cat\":\"mlisp\",\"ph\":\"X\","
+                             "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                             event.name, event.start_ns / 1e3,
+                             event.duration_ns / 1e3, getpid(), tid);
+                if (event.detail[0] != '\0') {
+                    std::fputs(",\"args\":{\"detail\":", TRACE_FILE);
+                    write_json_string(TRACE_FILE, event.detail);
+                    std::fputc('}', TRACE_FILE);
+                }
+                std::fputc('}', TRACE_FILE);
+            }
+        }
+        events.clear();
+    }
+
+public:
+    TraceBuffer() {
+        static std::atomic<int> next_tid(1);
+        tid = next_tid++;
+        std::lock_guard<std::mutex> lock(TRACE_MUTEX);
+        buffers.insert(this);
+    }
+
+    ~TraceBuffer() {
+        std::lock_guard<std::mutex> lock(TRACE_MUTEX);
+        write_locked();
+        buffers.erase(this);
+    }
+
+    void record(const char *name, const char *detail, uint64_t start_ns,
+                uint64_t duration_ns) {
+        if (events.size() == TRACE_BUFFER_EVENTS) {
+            std::lock_guard<std::mutex> lock(TRACE_MUTEX);
+            write_locked();
+        }
+        events.reserve(TRACE_BUFFER_EVENTS);
+        events.emplace_back();
+        auto &event = events.back();
+        event.name = name;
+        std::snprintf(event.detail, sizeof(event.detail), "%s", detail);
+        event.start_ns = start_ns;
+        event.duration_ns = duration_ns;
+    }
+
+    // Writes out the events of every thread. Only safe while other threads
+    // aren't tracing.
+    static void write_all() {
+        std::lock_guard<std::mutex> lock(TRACE_MUTEX);
+        for (auto buffer : buffers) {
+            buffer->write_locked();
+        }
+    }
+};
+
+std::set<TraceBuffer *> TraceBuffer::buffers;
+
+static thread_local TraceBuffer TRACE_BUFFER;
+
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - TRACE_START)
+        .count();
+}
+
+bool open_trace(const std::string &path) {
+    TRACE_FILE = std::fopen(path.c_str(), "w");
+    if (TRACE_FILE == nullptr) {
+        return false;
+    }
+    std::setvbuf(TRACE_FILE, nullptr, _IOFBF, 1 << 20);
+    std::fputs("[\n", TRACE_FILE);
+    TRACE_FIRST_EVENT = true;
+    return true;
+}
+
+bool start_trace(const std::string &path) {
+    if (!open_trace(path)) {
+        return false;
+    }
+    TRACE_PATH = path;
+    TRACE_START = std::chrono::steady_clock::now();
+    TRACING = true;
+    return true;
+}
+
+// Writes out the pending events before forking, so that the child inherits
+// no buffered output which both processes would write.
+void flush_trace_before_fork() {
+    if (TRACE_FILE != nullptr) {
+        TraceBuffer::write_all();
+        std::fflush(TRACE_FILE);
+    }
+}
+
+// Moves the trace of a forked child to a file of its own, PATH.PID, since
+// processes can't share a FILE. The child must call stop_trace before it
+// exits.
+void trace_forked_child() {
+    if (TRACE_FILE == nullptr) {
+        return;
+    }
+    std::fclose(TRACE_FILE);
+    auto path = TRACE_PATH + "." + std::to_string(getpid());
+    if (!open_trace(path)) {
+        std::cerr << "faild to open file " << path << std::endl;
+        TRACING = false;
+    }
+}
+
+void stop_trace() {
+    TRACING = false;
+    if (TRACE_FILE == nullptr) {
+        return;
+    }
+    TraceBuffer::write_all();
+    std::lock_guard<std::mutex> lock(TRACE_MUTEX);
+    std::fputs("\n]\n", TRACE_FILE);
+    std::fclose(TRACE_FILE);
+    TRACE_FILE = nullptr;
+}
+
+// Records a span named `name` over its lifetime while tracing, unless it took
+// less than `min_ns`. Negative `min_ns` disables the span.
+class TraceSpan {
+private:
+    const char *name;
+    std::string detail;
+    long min_ns;
+    bool active;
+    uint64_t start_ns;
+
+public:
+    TraceSpan(const char *name, const char *detail = "", long min_ns = 0)
+        : name(name),
+          min_ns(min_ns),
+          active(min_ns >= 0 && TRACING.load(std::memory_order_relaxed)) {
+        if (active) {
+            this->detail = detail;
+            start_ns = trace_now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (!active) {
+            return;
+        }
+        uint64_t duration_ns = trace_now() - start_ns;
+        if (duration_ns >= static_cast<uint64_t>(min_ns)) {
+            TRACE_BUFFER.record(name, detail.c_str(), start_ns, duration_ns);
+        }
+    }
+
+    bool is_active() const { return active; }
+
+    void set_detail(const std::string &detail) { this->detail = detail; }
+};
+
+// Fires the function entry and return probes around a call, including calls
+// left by an exception.
+class FunctionProbe {
+private:
+    const char *name;
+
+public:
+    FunctionProbe(const char *name) : name(name) {
+        MLISP_PROBE1(function__entry, name);
+    }
+
+    ~FunctionProbe() { MLISP_PROBE1(function__return, name); }
+};
+
+// Dispatch histogram.
+//
+// Built with MLISP_DISPATCH_STATS, `eval` counts the kinds of objects it
+// evaluates, `eval_list` the kinds of callees it applies and every buildin
+// its calls, and the counts are printed at exit. Otherwise DISPATCH_COUNT
+// compiles to nothing.
+
+#ifdef MLISP_DISPATCH_STATS
+struct DispatchStats {
+    std::atomic<uint64_t> evaluated[OBJECT_KIND_COUNT];
+    std::atomic<uint64_t> applied[OBJECT_KIND_COUNT];
+};
+
+static DispatchStats DISPATCH_STATS;
+
+#define DISPATCH_COUNT(counts, kind)                         \
+    DISPATCH_STATS.counts[static_cast<int>(kind)].fetch_add( \
+        1, std::memory_order_relaxed)
+
+void print_dispatch_counts(std::ostream &os, const char *title,
+                           const std::atomic<uint64_t> *counts) {
+    std::vector<std::pair<uint64_t, const char *>> entries;
+    uint64_t total = 0;
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        if (counts[i] != 0) {
+            entries.emplace_back(counts[i], kind_name(ObjectKind(i)));
+            total += counts[i];
+        }
+    }
+    std::sort(entries.rbegin(), entries.rend());
+    os << title << " (" << total << ")\n";
+    char line[256];
+    for (const auto &entry : entries) {
+        std::snprintf(line, sizeof(line), "%14lu %6.2f%%  %s\n", entry.first,
+                      entry.first * 100.0 / total, entry.second);
+        os << line;
+    }
+}
+
+// Prints the histograms, with the `top` most called buildins bound in `env`.
+void print_dispatch_stats(std::ostream &os, const Env &env, size_t top) {
+    print_dispatch_counts(os, "evaluated", DISPATCH_STATS.evaluated);
+    print_dispatch_counts(os, "applied", DISPATCH_STATS.applied);
+
+    std::vector<std::pair<uint64_t, std::string>> buildins;
+    uint64_t total = 0;
+    env.for_each([&](const std::string &name,
+                     const std::shared_ptr<Object> &value) {
+        if (value->kind() != ObjectKind::FuncPtr) {
+            return;
+        }
+        auto calls = std::static_pointer_cast<FuncPtr>(value)->get_calls();
+        if (calls != 0) {
+            buildins.emplace_back(calls, name);
+            total += calls;
+        }
+    });
+    std::sort(buildins.rbegin(), buildins.rend());
+    buildins.resize(std::min(buildins.size(), top));
+    os << "top buildins (" << total << ")\n";
+    char line[256];
+    for (const auto &buildin : buildins) {
+        std::snprintf(line, sizeof(line), "%14lu %6.2f%%  %s\n",
+                      buildin.first,
+                      total > 0 ? buildin.first * 100.0 / total : 0.0,
+                      buildin.second.c_str());
+        os << line;
+    }
+}
+#else
+#define DISPATCH_COUNT(counts, kind) ((void)0)
+#endif
+
+// Evaluation limits.
+//
+// eval and function entry take a step from FUEL, and only call out of line
+// once it runs out. Without limits it never does.
+
+static thread_local long FUEL = LONG_MAX;
+
+void out_of_fuel();
+
+inline void consume_fuel() {
+    if (--FUEL < 0) {
+        out_of_fuel();
+    }
+}
+
+// Maintains the per call instrumentations over the application of a function.
+class CallFrame {
+private:
+    unsigned instrumentation;
+
+    // Kept out of line, so that the frames of the callers, which recursion
+    // stacks up, don't grow when instrumentation is off.
+    [[gnu::noinline, gnu::cold]] static void enter(unsigned instrumentation,
+                                                   const char *name) {
+        if (instrumentation & INSTRUMENT_SHADOW_STACK) {
+            auto &stack = SHADOW_STACK;
+            if (stack.depth < SHADOW_STACK_DEPTH) {
+                stack.frames[stack.depth] = name;
+            }
+            // The frame must be in place before the handler can see it.
+            std::atomic_signal_fence(std::memory_order_release);
+            stack.depth = stack.depth + 1;
+        }
+        if (instrumentation & INSTRUMENT_CALL_PROFILE) {
+            CALL_PROFILER.enter(name);
+        }
+    }
+
+    [[gnu::noinline, gnu::cold]] static void leave(unsigned instrumentation) {
+        if (instrumentation & INSTRUMENT_CALL_PROFILE) {
+            CALL_PROFILER.leave();
+        }
+        if (instrumentation & INSTRUMENT_SHADOW_STACK) {
+            SHADOW_STACK.depth = SHADOW_STACK.depth - 1;
+        }
+    }
+
+public:
+    CallFrame(const char *name)
+        : instrumentation(INSTRUMENTATION.load(std::memory_order_relaxed)) {
+        consume_fuel();
+        bump(thread_counters().calls);
+        if (instrumentation != 0) {
+            enter(instrumentation, name);
+        }
+    }
+
+    ~CallFrame() {
+        if (instrumentation != 0) {
+            leave(instrumentation);
+        }
+    }
+};
+
+// Source positions of parsed lists.
+//
+// Spans live in side tables keyed by node, so that cells don't grow. Only
+// the first cell of each parenthesized list gets a span. Those cells are made
+// as SourceList, which knows the table holding its span and whose destructor
+// drops the span, so that a freed node's address can't pick up a stale span.
+
+// Where a parsed list starts. Columns and file ids saturate.
+struct SourceSpan {
+    uint32_t line;
+    uint16_t column;
+    uint16_t file;
+};
+
+// Spans keyed by node, in an open addressing table with linear probing. It
+// grows by half when 80% full, so a span takes 20 to 30 bytes where a node of
+// std::unordered_map takes over 32.
+class SpanTable {
+private:
+    struct Slot {
+        const Object *node;
+        SourceSpan span;
+    };
+
+    std::vector<Slot> slots;
+    size_t count = 0;
+
+    size_t home(const Object *node) const {
+        uint64_t hash =
+            reinterpret_cast<uintptr_t>(node) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(
+            (static_cast<unsigned __int128>(hash) * slots.size()) >> 64);
+    }
+
+    size_t next(size_t i) const { return i + 1 == slots.size() ? 0 : i + 1; }
+
+    void grow() {
+        std::vector<Slot> old(std::max<size_t>(16, slots.size() * 3 / 2),
+                              Slot{nullptr, {0, 0, 0}});
+        old.swap(slots);
+        count = 0;
+        for (const Slot &slot : old) {
+            if (slot.node != nullptr) {
+                insert(slot.node, slot.span);
+            }
+        }
+    }
+
+public:
+    void insert(const Object *node, const SourceSpan &span) {
+        if ((count + 1) * 5 > slots.size() * 4) {
+            grow();
+        }
+        size_t i = home(node);
+        while (slots[i].node != nullptr && slots[i].node != node) {
+            i = next(i);
+        }
+        if (slots[i].node == nullptr) {
+            count++;
+        }
+        slots[i] = Slot{node, span};
+    }
+
+    const SourceSpan *find(const Object *node) const {
+        if (slots.empty()) {
+            return nullptr;
+        }
+        for (size_t i = home(node); slots[i].node != nullptr; i = next(i)) {
+            if (slots[i].node == node) {
+                return &slots[i].span;
+            }
+        }
+        return nullptr;
+    }
+
+    // Removes the span of `node` and moves back the slots after it which
+    // could no longer be found.
+    void erase(const Object *node) {
+        if (slots.empty()) {
+            return;
+        }
+        size_t i = home(node);
+        while (slots[i].node != node) {
+            if (slots[i].node == nullptr) {
+                return;
+            }
+            i = next(i);
+        }
+        count--;
+        for (size_t j = next(i); slots[j].node != nullptr; j = next(j)) {
+            size_t k = home(slots[j].node);
+            bool reachable = i <= j ? i < k && k <= j : i < k || k <= j;
+            if (!reachable) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i].node = nullptr;
+    }
+
+    size_t size() const { return count; }
+
+    size_t bytes() const { return slots.capacity() * sizeof(Slot); }
+};
+
+// Spans of the lists parsed by one thread. Each thread inserts into a shard
+// of its own, so threads parsing at once don't contend. A list keeps its
+// shard, whose lock another thread only takes when it frees the list. The
+// shard of an exited thread is handed to the next thread which needs one.
+struct SpanShard {
+    std::mutex mutex;
+    SpanTable spans;
+};
+
+struct SourceTable {
+    std::mutex mutex;
+    std::vector<SpanShard *> shards;
+    std::vector<SpanShard *> free_shards;
+    std::vector<std::string> files = {"?"};
+    std::unordered_map<std::string, uint16_t> file_ids;
+};
+
+// Never freed, nor are the shards, so that lists freed at exit can still drop
+// their spans.
+SourceTable &source_table() {
+    static SourceTable *table = new SourceTable;
+    return *table;
+}
+
+class SpanShardHolder {
+private:
+    SpanShard *shard;
+
+public:
+    SpanShardHolder() : shard(nullptr) {}
+
+    ~SpanShardHolder() {
+        if (shard != nullptr) {
+            SourceTable &table = source_table();
+            std::lock_guard<std::mutex> lock(table.mutex);
+            table.free_shards.push_back(shard);
+        }
+    }
+
+    SpanShard &get() {
+        if (shard == nullptr) {
+            SourceTable &table = source_table();
+            std::lock_guard<std::mutex> lock(table.mutex);
+            if (!table.free_shards.empty()) {
+                shard = table.free_shards.back();
+                table.free_shards.pop_back();
+            } else {
+                shard = new SpanShard;
+                table.shards.push_back(shard);
+            }
+        }
+        return *shard;
+    }
+};
+
+static thread_local SpanShardHolder SPAN_SHARD;
+
+// Source file of the forms parsed by this thread.
+static thread_local uint16_t PARSE_FILE = 0;
+
+uint16_t source_file_id(const std::string &name) {
+    SourceTable &table = source_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto it = table.file_ids.find(name);
+    if (it != table.file_ids.end()) {
+        return it->second;
+    }
+    if (table.files.size() > UINT16_MAX) {
+        return 0;
+    }
+    uint16_t id = table.files.size();
+    table.files.push_back(name);
+    table.file_ids.emplace(name, id);
+    return id;
+}
+
+class SourceList : public List {
+private:
+    SpanShard *shard;
+
+public:
+    SourceList(std::shared_ptr<Object> value, SpanShard *shard)
+        : List(value), shard(shard) {}
+
+    ~SourceList() override {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->spans.erase(this);
+    }
+
+    SpanShard *get_shard() const { return shard; }
+};
+
+// Returns "file:line:column" of `obj`, or "" if it has no span.
+std::string source_location(const std::shared_ptr<Object> &obj) {
+    auto list = dynamic_cast<const SourceList *>(obj.get());
+    if (list == nullptr) {
+        return "";
+    }
+    SourceSpan span;
+    {
+        std::lock_guard<std::mutex> lock(list->get_shard()->mutex);
+        const SourceSpan *found = list->get_shard()->spans.find(list);
+        if (found == nullptr) {
+            return "";
+        }
+        span = *found;
+    }
+    SourceTable &table = source_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    return table.files[span.file] + ":" + std::to_string(span.line) + ":" +
+           std::to_string(span.column);
+}
+
+// Number of spans and the bytes the tables take for them.
+void source_span_usage(size_t &spans, size_t &bytes) {
+    SourceTable &table = source_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    spans = 0;
+    bytes = 0;
+    for (auto shard : table.shards) {
+        std::lock_guard<std::mutex> shard_lock(shard->mutex);
+        spans += shard->spans.size();
+        bytes += shard->spans.bytes();
+    }
+}
+
+// Makes the first cell of a list which starts at `position`.
+std::shared_ptr<List> make_source_list(std::shared_ptr<Object> value,
+                                       const SourcePosition &position) {
+    SpanShard &shard = SPAN_SHARD.get();
+    auto list = make_object<SourceList>(value, &shard);
+    SourceSpan span = {
+        position.line,
+        static_cast<uint16_t>(std::min<uint32_t>(position.column, UINT16_MAX)),
+        PARSE_FILE};
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.spans.insert(list.get(), span);
+    return list;
+}
+
+class ParseException : public std::runtime_error {
+public:
+    ParseException(const std::string &msg) : std::runtime_error(msg) {
+        count_exception();
+    }
+};
+
+std::vector<std::shared_ptr<Object>> parse(
+    const std::vector<std::shared_ptr<Token>> &tokens);
+std::shared_ptr<Object> parse_object(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Integer> parse_int(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Number> parse_num(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<String> parse_str(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Symbol> parse_sym(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Object> parse_list(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Quoted> parse_quote(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<BackQuoted> parse_back_quote(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<Comma> parse_comma(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+std::shared_ptr<CommaAtmark> parse_comma_atmark(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last);
+
+std::vector<std::shared_ptr<Object>> parse(
+    const std::vector<std::shared_ptr<Token>> &tokens) {
+    std::vector<std::shared_ptr<Object>> atoms = {};
+    auto it = tokens.begin();
+    const auto last = tokens.end();
+    while (it != tokens.end()) {
+        atoms.push_back(parse_object(it, last));
+    }
+    return atoms;
+}
+
+std::shared_ptr<Object> parse_object(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    }
+
+    switch ((*it)->kind()) {
+        case TokenKind::Integer:
+            return parse_int(it, last);
+        case TokenKind::Number:
+            return parse_num(it, last);
+        case TokenKind::String:
+            return parse_str(it, last);
+        case TokenKind::LParen:
+            return parse_list(it, last);
+        case TokenKind::Ident:
+            return parse_sym(it, last);
+        case TokenKind::Quote:
+            return parse_quote(it, last);
+        case TokenKind::BackQuote:
+            return parse_back_quote(it, last);
+        case TokenKind::Comma:
+            return parse_comma(it, last);
+        case TokenKind::CommaAtmark:
+            return parse_comma_atmark(it, last);
+        default:
+            std::ostringstream ss;
+            ss << "unexpected token " << (*it)->debug();
+            ss << " found: expect integer, number ( or identifier";
+            throw ParseException(ss.str());
+    }
+}
+
+std::shared_ptr<Integer> parse_int(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::Integer) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug()
+           << " found: expected integer";
+        throw ParseException(ss.str());
+    } else {
+        const std::shared_ptr<IntegerToken> integer =
+            std::static_pointer_cast<IntegerToken>(*it);
+        it++;
+        return make_object<Integer>(integer->get_integer());
+    }
+}
+
+std::shared_ptr<Number> parse_num(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::Number) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug()
+           << " found: expected number";
+        throw ParseException(ss.str());
+    } else {
+        const std::shared_ptr<NumberToken> number =
+            std::static_pointer_cast<NumberToken>(*it);
+        it++;
+        return make_object<Number>(number->get_number());
+    }
+}
+
+std::shared_ptr<String> parse_str(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::String) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug()
+           << " found: expected string";
+        throw ParseException(ss.str());
+    } else {
+        const std::shared_ptr<StringToken> string =
+            std::static_pointer_cast<StringToken>(*it);
+        it++;
+        return make_object<String>(string->get_string());
+    }
+}
+
+std::shared_ptr<Symbol> parse_sym(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::Ident) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug()
+           << " found: expected identifier";
+        throw ParseException(ss.str());
+    } else {
+        const std::shared_ptr<IdentToken> ident =
+            std::static_pointer_cast<IdentToken>(*it);
+        it++;
+        return make_object<Symbol>(ident->get_ident());
+    }
+}
+
+std::shared_ptr<Object> parse_list(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::LParen) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug() << " found: expected (";
+        throw ParseException(ss.str());
+    }
+    const SourcePosition position = (*it)->get_position();
+    it++;
+
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() == TokenKind::RParen) {
+        it++;
+        return GLOBAL_NIL;
+    } else {
+        std::shared_ptr<List> list =
+            make_source_list(parse_object(it, last), position);
+        while (true) {
+            if (it == last) {
+                throw ParseException("expected token, but not found");
+            } else if ((*it)->kind() == TokenKind::RParen) {
+                it++;
+                break;
+            } else {
+                list->append(make_object<List>(parse_object(it, last)));
+            }
+        }
+        return list;
+    }
+}
+
+std::shared_ptr<Quoted> parse_quote(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::Quote) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug() << " found: expected '";
+        throw ParseException(ss.str());
+    } else {
+        it++;
+        return make_object<Quoted>(parse_object(it, last));
+    }
+}
+
+std::shared_ptr<BackQuoted> parse_back_quote(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::BackQuote) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug() << " found: expected `";
+        throw ParseException(ss.str());
+    } else {
+        it++;
+        return make_object<BackQuoted>(parse_object(it, last));
+    }
+}
+
+std::shared_ptr<Comma> parse_comma(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::Comma) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug() << " found: expected ,";
+        throw ParseException(ss.str());
+    } else {
+        it++;
+        return make_object<Comma>(parse_object(it, last));
+    }
+}
+
+std::shared_ptr<CommaAtmark> parse_comma_atmark(
+    std::vector<std::shared_ptr<Token>>::const_iterator &it,
+    const std::vector<std::shared_ptr<Token>>::const_iterator &last) {
+    if (it == last) {
+        throw ParseException("expected token, but not found");
+    } else if ((*it)->kind() != TokenKind::CommaAtmark) {
+        std::ostringstream ss;
+        ss << "unexpected token " << (*it)->debug() << " found: expected ,@";
+        throw ParseException(ss.str());
+    } else {
+        it++;
+        return make_object<CommaAtmark>(parse_object(it, last));
+    }
+}
+
+class EvalException : public std::exception {
+private:
+    // Formats the message on the first call of `what`, for errors which are
+    // often handled without looking at it.
+    mutable std::function<std::string()> format;
+    mutable std::string message;
+
+public:
+    EvalException(const std::string &msg) : message(msg) {
+        count_exception();
+        MLISP_PROBE1(eval__exception, message.c_str());
+    }
+
+    // The probe doesn't get the message, which would defeat the laziness.
+    EvalException(std::function<std::string()> format)
+        : format(std::move(format)) {
+        count_exception();
+        MLISP_PROBE1(eval__exception, "");
+    }
+
+    const char *what() const noexcept override {
+        if (format) {
+            try {
+                message = format();
+            } catch (...) {
+                message = "error while formatting an error";
+            }
+            format = nullptr;
+        }
+        return message.c_str();
+    }
+};
+
+void heap_limit_exceeded() { throw EvalException("heap limit exceeded"); }
+
+// Raised when an evaluation runs out of steps or time.
+class LimitExceeded : public EvalException {
+public:
+    LimitExceeded(const std::string &msg) : EvalException(msg) {}
+};
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// Steps between checks of the deadline.
+const long DEADLINE_CHECK_STEPS = 1024;
+
+// Steps left besides FUEL, or LONG_MAX for no limit.
+static thread_local long STEPS_LEFT = LONG_MAX;
+static thread_local Deadline DEADLINE = Deadline::max();
+
+// Steps and milliseconds each top level form and server request may take,
+// or -1 for no limit.
+static long MAX_STEPS = -1;
+static long TIMEOUT_MS = -1;
+
+long steps_left() {
+    return STEPS_LEFT == LONG_MAX ? LONG_MAX : STEPS_LEFT + std::max(FUEL, 0l);
+}
+
+// Hands out the next batch of fuel, which ends at the next deadline check.
+void refuel() {
+    long batch = DEADLINE != Deadline::max() ? DEADLINE_CHECK_STEPS : LONG_MAX;
+    if (STEPS_LEFT != LONG_MAX) {
+        batch = std::min(batch, STEPS_LEFT);
+        STEPS_LEFT -= batch;
+    }
+    FUEL = batch;
+}
+
+// Whether this thread evaluates under a step, time or heap limit.
+bool limits_active() {
+    return STEPS_LEFT != LONG_MAX || DEADLINE != Deadline::max() ||
+           HEAP_LIMIT != INT64_MAX;
+}
+
+// Whether the limits in effect have run out. After a LimitExceeded, this
+// tells whether it came from them or from limits nested within and since
+// restored.
+bool limits_exhausted() {
+    return steps_left() == 0 ||
+           (DEADLINE != Deadline::max() &&
+            std::chrono::steady_clock::now() >= DEADLINE);
+}
+
+void out_of_fuel() {
+    if (DEADLINE != Deadline::max() &&
+        std::chrono::steady_clock::now() >= DEADLINE) {
+        FUEL = 0;
+        throw LimitExceeded("time limit exceeded");
+    }
+    if (STEPS_LEFT == 0) {
+        FUEL = 0;
+        throw LimitExceeded("step limit exceeded");
+    }
+    refuel();
+    // This step takes from the new batch.
+    FUEL--;
+}
+
+// Limits this thread to `steps` more steps and `ms` more milliseconds, -1 for
+// no limit, while this lives. Limits only ever get stricter when nested, and
+// steps taken count towards the outer limits too.
+class EvalLimits {
+private:
+    long saved_steps;
+    Deadline saved_deadline;
+    long granted;
+
+public:
+    EvalLimits(long steps, long ms)
+        : saved_steps(steps_left()), saved_deadline(DEADLINE) {
+        granted = steps >= 0 ? std::min(saved_steps, steps) : saved_steps;
+        if (ms >= 0) {
+            DEADLINE = std::min(DEADLINE, std::chrono::steady_clock::now() +
+                                              std::chrono::milliseconds(ms));
+        }
+        STEPS_LEFT = granted;
+        refuel();
+    }
+
+    ~EvalLimits() {
+        STEPS_LEFT = saved_steps == LONG_MAX
+                         ? LONG_MAX
+                         : saved_steps - (granted - steps_left());
+        DEADLINE = saved_deadline;
+        refuel();
+    }
+};
+
+// Returns `body()` evaluated within the given limits. If it runs out of them,
+// the bindings it set in `env` are restored before the error propagates.
+template <typename F>
+std::shared_ptr<Object> eval_with_limits(Env &env, long steps, long ms,
+                                         F body) {
+    EvalLimits limits(steps, ms);
+    size_t mark = env.snapshot();
+    std::shared_ptr<Object> result;
+    try {
+        result = body();
+    } catch (LimitExceeded &) {
+        env.rollback(mark);
+        throw;
+    } catch (...) {
+        env.release(mark);
+        throw;
+    }
+    env.release(mark);
+    return result;
+}
+
+#define TAKE_JUST_ONE_ARG(name, args, a1)                                      \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+        if (args->get_next() != nullptr) {                                     \
+            throw EvalException("too many arguments for " +                    \
+                                std::string(name));                            \
+        }                                                                      \
+    } while (0)
+
+#define TAKE_JUST_TWO_ARG(name, args, a1, a2)                                  \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+        if (args->get_next() == nullptr) {                                     \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a2 = args->get_next()->get_value();                                    \
+        if (args->get_next()->get_next() != nullptr) {                         \
+            throw EvalException("too many arguments for " +                    \
+                                std::string(name));                            \
+        }                                                                      \
+    } while (0)
+
+#define TAKE_JUST_THREE_ARG(name, args, a1, a2, a3)                            \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+        if (args->get_next() == nullptr) {                                     \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a2 = args->get_next()->get_value();                                    \
+        if (args->get_next()->get_next() == nullptr) {                         \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a3 = args->get_next()->get_next()->get_value();                        \
+        if (args->get_next()->get_next()->get_next() != nullptr) {             \
+            throw EvalException("too many arguments for " +                    \
+                                std::string(name));                            \
+        }                                                                      \
+    } while (0)
+
+// A `throw` returning to its `catch`. Rather than unwinding with a C++
+// exception, `throw` sets THROWING and returns, and everything which
+// evaluates a form returns as soon as it sees THROWING set, until the `catch`
+// whose tag matches takes the value and clears it.
+static thread_local bool THROWING = false;
+static thread_local std::shared_ptr<Object> THROWN_TAG;
+static thread_local std::shared_ptr<Object> THROWN_VALUE;
+
+// Returns from the enclosing function while a `throw` returns to its catch.
+#define RETURN_IF_THROWING()   \
+    do {                       \
+        if (THROWING) {        \
+            return GLOBAL_NIL; \
+        }                      \
+    } while (0)
+
+#define EVAL_JUST_ONE_ARG(name, args, env, a1) \
+    do {                                       \
+        TAKE_JUST_ONE_ARG(name, args, a1);     \
+        a1 = eval(a1, env);                    \
+        RETURN_IF_THROWING();                  \
+    } while (0)
+
+#define EVAL_JUST_TWO_ARG(name, args, env, a1, a2) \
+    do {                                           \
+        TAKE_JUST_TWO_ARG(name, args, a1, a2);     \
+        a1 = eval(a1, env);                        \
+        RETURN_IF_THROWING();                      \
+        a2 = eval(a2, env);                        \
+        RETURN_IF_THROWING();                      \
+    } while (0)
+
+#define EVAL_JUST_THREE_ARG(name, args, env, a1, a2, a3) \
+    do {                                                 \
+        TAKE_JUST_THREE_ARG(name, args, a1, a2, a3);     \
+        a1 = eval(a1, env);                              \
+        RETURN_IF_THROWING();                            \
+        a2 = eval(a2, env);                              \
+        RETURN_IF_THROWING();                            \
+        a3 = eval(a3, env);                              \
+        RETURN_IF_THROWING();                            \
+    } while (0)
+
+#define TAKE_ONE_ARG(name, args, a1)                                           \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+    } while (0)
+
+#define TAKE_TWO_ARG(name, args, a1, a2)                                       \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+        if (args->get_next() == nullptr) {                                     \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a2 = args->get_next()->get_value();                                    \
+    } while (0)
+
+#define TAKE_THREE_ARG(name, args, a1, a2, a3)                                 \
+    do {                                                                       \
+        if (args == nullptr) {                                                 \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a1 = args->get_value();                                                \
+        if (args->get_next() == nullptr) {                                     \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a2 = args->get_next()->get_value();                                    \
+        if (args->get_next()->get_next() == nullptr) {                         \
+            throw EvalException("too few arguments for " + std::string(name)); \
+        }                                                                      \
+        a3 = args->get_next()->get_next()->get_value();                        \
+    } while (0)
+
+#define EVAL_ONE_ARG(name, args, env, a1) \
+    do {                                  \
+        TAKE_ONE_ARG(name, args, a1);     \
+        a1 = eval(a1, env);               \
+        RETURN_IF_THROWING();             \
+    } while (0)
+
+#define EVAL_TWO_ARG(name, args, env, a1, a2) \
+    do {                                      \
+        TAKE_TWO_ARG(name, args, a1, a2);     \
+        a1 = eval(a1, env);                   \
+        RETURN_IF_THROWING();                 \
+        a2 = eval(a2, env);                   \
+        RETURN_IF_THROWING();                 \
+    } while (0)
+
+#define EVAL_THREE_ARG(name, args, env, a1, a2, a3) \
+    do {                                            \
+        TAKE_THREE_ARG(name, args, a1, a2, a3);     \
+        a1 = eval(a1, env);                         \
+        RETURN_IF_THROWING();                       \
+        a2 = eval(a2, env);                         \
+        RETURN_IF_THROWING();                       \
+        a3 = eval(a3, env);                         \
+        RETURN_IF_THROWING();                       \
+    } while (0)
+
+std::shared_ptr<Object> eval(const std::shared_ptr<Object> &object, Env &env);
+std::shared_ptr<Object> eval_backquoted(const std::shared_ptr<Object> &object,
+                                        Env &env);
+std::shared_ptr<Object> eval_backquoted_list(const std::shared_ptr<List> &list,
+                                             Env &env);
+std::list<std::shared_ptr<Object>> eval_backquoted_inner(
+    const std::shared_ptr<Object> &object, Env &env);
+std::shared_ptr<Object> eval_list(const std::shared_ptr<List> &list, Env &env);
+std::shared_ptr<Object> eval_symbol(const std::shared_ptr<Symbol> &symbol,
+                                    Env &env);
+void assign_macro_sym(
+    std::list<std::shared_ptr<Symbol>>::iterator &sym_it,
+    const std::list<std::shared_ptr<Symbol>>::iterator &sym_last,
+    std::list<std::shared_ptr<Object>>::iterator &arg_it,
+    const std::list<std::shared_ptr<Object>>::iterator &arg_last, Env &env);
+std::list<std::shared_ptr<Object>> expand_macro(
+    const std::shared_ptr<Macro> macro, const std::shared_ptr<List> args,
+    Env &env);
+std::shared_ptr<Object> apply_macro(const std::shared_ptr<Macro> macro,
+                                    const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> apply_part_func_ptr(
+    const std::shared_ptr<PartiallyAppliedFuncPtr> func,
+    const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> apply_func_ptr(const std::shared_ptr<FuncPtr> func,
+                                       const std::shared_ptr<List> args,
+                                       Env &env);
+std::shared_ptr<Object> apply_part_func(
+    const std::shared_ptr<PartiallyAppliedFunction> func,
+    const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> apply_func(const std::shared_ptr<Function> func,
+                                   const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_quote(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_list(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_car(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_cdr(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_cons(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_rplaca(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_rplacd(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_atom(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_if(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_eq_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_ne_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_lt_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_gt_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_le_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_ge_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_add_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_sub_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_mul_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_div_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_string_nth(const std::shared_ptr<List> args,
+                                      Env &env);
+std::shared_ptr<Object> fn_eq_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_ne_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_lt_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_gt_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_le_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_ge_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_equal_str(const std::shared_ptr<List> args,
+                                     Env &env);
+std::shared_ptr<Object> fn_write(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_write_line(const std::shared_ptr<List> args,
+                                      Env &env);
+std::shared_ptr<Object> fn_print(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_prin1(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_princ(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_read_str(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_read_int(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_read_num(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_lambda(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_macro(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_set(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_int_to_string(const std::shared_ptr<List> args,
+                                         Env &env);
+std::shared_ptr<Object> fn_num_to_string(const std::shared_ptr<List> args,
+                                         Env &env);
+std::shared_ptr<Object> fn_debug(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_type_of(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_concat(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_macroexpand(const std::shared_ptr<List> args,
+                                       Env &env);
+std::shared_ptr<Object> fn_auto_parallel_count(
+    const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_with_profiling(const std::shared_ptr<List> args,
+                                          Env &env);
+std::shared_ptr<Object> fn_alloc_stats(const std::shared_ptr<List> args,
+                                       Env &env);
+std::shared_ptr<Object> fn_time(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_room(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_with_counters(const std::shared_ptr<List> args,
+                                         Env &env);
+std::shared_ptr<Object> fn_get_internal_real_time(
+    const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_with_memory_limit(const std::shared_ptr<List> args,
+                                             Env &env);
+std::shared_ptr<Object> fn_catch(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_throw(const std::shared_ptr<List> args, Env &env);
+std::shared_ptr<Object> fn_handler_case(const std::shared_ptr<List> args,
+                                        Env &env);
+std::shared_ptr<Object> fn_with_limits(const std::shared_ptr<List> args,
+                                       Env &env);
+std::shared_ptr<List> eval_args_in_parallel(
+    const std::shared_ptr<Object> &callee, const std::shared_ptr<List> &args,
+    Env &env);
+
+std::shared_ptr<Object> eval(const std::shared_ptr<Object> &object, Env &env) {
+    consume_fuel();
+    bump(thread_counters().eval_steps);
+    DISPATCH_COUNT(evaluated, object->kind());
+    switch (object->kind()) {
+        case ObjectKind::T:
+        case ObjectKind::NIL:
+        case ObjectKind::Integer:
+        case ObjectKind::Number:
+        case ObjectKind::String:
+        case ObjectKind::Function:
+        case ObjectKind::FuncPtr:
+        case ObjectKind::PartiallyAppliedFunction:
+        case ObjectKind::PartiallyAppliedFuncPtr:
+        case ObjectKind::Macro:
+            return object;
+        case ObjectKind::List:
+            return eval_list(std::static_pointer_cast<List>(object), env);
+        case ObjectKind::Symbol:
+            return eval_symbol(std::static_pointer_cast<Symbol>(object), env);
+        case ObjectKind::Quoted:
+            return std::static_pointer_cast<Quoted>(object)->get_object();
+        case ObjectKind::BackQuoted:
+            // TODO: This algorithm can't evaluate `(',@(list 10 20)) to ((quote
+            // 10 20)) like clisp does.
+            return eval_backquoted(
+                std::static_pointer_cast<BackQuoted>(object)->get_object(),
+                env);
+        case ObjectKind::Comma:
+        case ObjectKind::CommaAtmark:
+            throw EvalException("comma is invalid outside of backquote");
+        default:
+            throw EvalException("unreachable");
+    }
+}
+
+std::shared_ptr<Object> eval_backquoted(const std::shared_ptr<Object> &object,
+                                        Env &env) {
+    if (object->kind() == ObjectKind::Quoted) {
+        auto inner = std::static_pointer_cast<Quoted>(object)->get_object();
+        return eval_backquoted(inner, env);
+    } else if (object->kind() == ObjectKind::Comma) {
+        auto inner = std::static_pointer_cast<Comma>(object)->get_object();
+        return eval(inner, env);
+    } else if (object->kind() == ObjectKind::List) {
+        return eval_backquoted_list(std::static_pointer_cast<List>(object),
+                                    env);
+    } else {
+        return object;
+    }
+}
+
+std::shared_ptr<Object> eval_backquoted_list(const std::shared_ptr<List> &list,
+                                             Env &env) {
+    std::list<std::shared_ptr<Object>> objs;
+    auto list_it = list;
+    while (list_it != nullptr) {
+        auto object = list_it->get_value();
+        if (object->kind() == ObjectKind::Comma) {
+            auto inner = std::static_pointer_cast<Comma>(object)->get_object();
+            objs.push_back(eval(inner, env));
+            RETURN_IF_THROWING();
+        } else if (object->kind() == ObjectKind::CommaAtmark) {
+            auto inner = eval(
+                std::static_pointer_cast<CommaAtmark>(object)->get_object(),
+                env);
+            RETURN_IF_THROWING();
+            if (inner->kind() == ObjectKind::List) {
+                auto inner_it = std::static_pointer_cast<List>(inner);
+                while (inner_it != nullptr) {
+                    objs.push_back(inner_it->get_value());
+                    inner_it = inner_it->get_next();
+                }
+            } else if (inner->kind() != ObjectKind::NIL) {
+                objs.push_back(inner);
+            }
+        } else if (object->kind() == ObjectKind::Quoted) {
+            auto inner = std::static_pointer_cast<Quoted>(object)->get_object();
+            objs.push_back(make_object<Quoted>(eval_backquoted(inner, env)));
+            RETURN_IF_THROWING();
+        } else if (object->kind() == ObjectKind::BackQuoted) {
+            auto inner =
+                std::static_pointer_cast<BackQuoted>(object)->get_object();
+            objs.push_back(
+                make_object<BackQuoted>(eval_backquoted(inner, env)));
+            RETURN_IF_THROWING();
+        } else if (object->kind() == ObjectKind::List) {
+            objs.push_back(eval_backquoted_list(
+                std::static_pointer_cast<List>(object), env));
+            RETURN_IF_THROWING();
+        } else {
+            objs.push_back(object);
+        }
+        list_it = list_it->get_next();
+    }
+
+    if (objs.empty()) {
+        return GLOBAL_NIL;
+    }
+
+    auto new_list = make_object<List>(objs.front());
+    objs.pop_front();
+    while (!objs.empty()) {
+        new_list->append(make_object<List>(objs.front()));
+        objs.pop_front();
+    }
+    return new_list;
+}
+
+std::shared_ptr<Object> eval_list(const std::shared_ptr<List> &list, Env &env) {
+    auto first = eval(list->get_value(), env);
+    RETURN_IF_THROWING();
+    auto args = list->get_next();
+    if (AUTO_PARALLEL && !IN_PARALLEL_TASK) {
+        args = eval_args_in_parallel(first, args, env);
+    }
+
+    DISPATCH_COUNT(applied, first->kind());
+    if (first->kind() == ObjectKind::Function) {
+        auto func = std::static_pointer_cast<Function>(first);
+        return apply_func(func, args, env);
+    } else if (first->kind() == ObjectKind::FuncPtr) {
+        auto func = std::static_pointer_cast<FuncPtr>(first);
+        return apply_func_ptr(func, args, env);
+    } else if (first->kind() == ObjectKind::PartiallyAppliedFunction) {
+        auto func = std::static_pointer_cast<PartiallyAppliedFunction>(first);
+        return apply_part_func(func, args, env);
+    } else if (first->kind() == ObjectKind::PartiallyAppliedFuncPtr) {
+        auto func = std::static_pointer_cast<PartiallyAppliedFuncPtr>(first);
+        return apply_part_func_ptr(func, args, env);
+    } else if (first->kind() == ObjectKind::Macro) {
+        auto macro = std::static_pointer_cast<Macro>(first);
+        return apply_macro(macro, args, env);
+    } else {
+        throw EvalException("first object of list must be function or symbol");
+    }
+}
+
+void assign_macro_sym(
+    std::list<std::shared_ptr<Symbol>>::iterator &sym_it,
+    const std::list<std::shared_ptr<Symbol>>::iterator &sym_last,
+    std::list<std::shared_ptr<Object>>::iterator &arg_it,
+    const std::list<std::shared_ptr<Object>>::iterator &arg_last, Env &env) {
+    if (sym_it == sym_last) {
+        throw EvalException("too many arguments for macro");
+    }
+
+    if ((*sym_it)->get_symbol() == "&body") {
+        sym_it++;
+        if (sym_it == sym_last) {
+            throw EvalException("symbol expected after &body");
+        }
+
+        if (arg_it == arg_last) {
+            env.set_obj((*sym_it++)->get_symbol(), GLOBAL_NIL);
+            return;
+        }
+
+        auto body_list = make_object<List>(*arg_it++);
+        while (arg_it != arg_last) {
+            body_list->append(make_object<List>(*arg_it++));
+        }
+
+        env.set_obj((*sym_it++)->get_symbol(), body_list);
+
+        if (sym_it != sym_last) {
+            throw EvalException("more than two symbol after &body is invalid");
+        }
+    } else if ((*sym_it)->get_symbol() == "&optional") {
+        sym_it++;
+        if (sym_it == sym_last) {
+            throw EvalException("symbol expected after &optional");
+        }
+
+        while (sym_it != sym_last) {
+            if (arg_it == arg_last) {
+                env.set_obj((*sym_it++)->get_symbol(), GLOBAL_NIL);
+            } else {
+                env.set_obj((*sym_it++)->get_symbol(), *arg_it++);
+            }
+        }
+    } else {
+        if (arg_it != arg_last) {
+            env.set_obj((*sym_it++)->get_symbol(), *arg_it++);
+        } else {
+            std::ostringstream ss;
+            ss << "no object correspond with " << (*sym_it)->get_symbol();
+            throw EvalException(ss.str());
+        }
+    }
+}
+
+std::list<std::shared_ptr<Object>> expand_macro(
+    const std::shared_ptr<Macro> macro, const std::shared_ptr<List> args,
+    Env &env) {
+    TraceSpan span("expand_macro",
+                   macro->get_name() != nullptr ? macro->get_name() : "macro");
+    MLISP_PROBE1(macro__expand,
+                 macro->get_name() != nullptr ? macro->get_name() : "macro");
+    bump(thread_counters().macro_expansions);
+    std::list<std::shared_ptr<Object>> arg_list;
+    auto head = args;
+    while (head != nullptr) {
+        arg_list.push_back(head->get_value());
+        head = head->get_next();
+    }
+
+    Env temp_env(env);
+    auto sym_it = macro->get_params().begin();
+    const auto sym_last = macro->get_params().end();
+    auto arg_it = arg_list.begin();
+    const auto arg_last = arg_list.end();
+    while (sym_it != sym_last || arg_it != arg_last) {
+        assign_macro_sym(sym_it, sym_last, arg_it, arg_last, temp_env);
+    }
+
+    std::list<std::shared_ptr<Object>> list;
+    for (auto &body : macro->get_body()) {
+        list.push_back(eval(body, temp_env));
+        if (THROWING) {
+            return {};
+        }
+    }
+    return list;
+}
+
+std::shared_ptr<Object> apply_macro(const std::shared_ptr<Macro> macro,
+                                    const std::shared_ptr<List> args,
+                                    Env &env) {
+    CallFrame frame(macro->get_name() != nullptr ? macro->get_name()
+                                                 : "macro");
+    auto expanded_objs = expand_macro(macro, args, env);
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    for (auto &expanded_obj : expanded_objs) {
+        result = eval(expanded_obj, env);
+        RETURN_IF_THROWING();
+    }
+    return result;
+}
+
+std::shared_ptr<Object> apply_part_func_ptr(
+    const std::shared_ptr<PartiallyAppliedFuncPtr> func,
+    const std::shared_ptr<List> args, Env &env) {
+    auto new_args = func->get_args();
+    new_args->append(args);
+    return apply_func_ptr(func->get_func(), new_args, env);
+}
+
+std::shared_ptr<Object> apply_func_ptr(const std::shared_ptr<FuncPtr> func,
+                                       const std::shared_ptr<List> args,
+                                       Env &env) {
+    CallFrame frame(func->get_name() != nullptr ? func->get_name()
+                                                : "buildin");
+#ifdef MLISP_DISPATCH_STATS
+    func->count_call();
+#endif
+    return func->get_func()(args, env);
+}
+
+std::shared_ptr<Object> apply_part_func(
+    const std::shared_ptr<PartiallyAppliedFunction> func,
+    const std::shared_ptr<List> args, Env &env) {
+    auto new_args = func->get_args();
+    new_args->append(args);
+    return apply_func(func->get_func(), new_args, env);
+}
+
+std::shared_ptr<Object> apply_func(const std::shared_ptr<Function> func,
+                                   const std::shared_ptr<List> args, Env &env) {
+    const char *name =
+        func->get_name() != nullptr ? func->get_name() : "lambda";
+    CallFrame frame(name);
+    TraceSpan span("call", name, TRACE_CALL_THRESHOLD_NS);
+    FunctionProbe probe(name);
+    std::list<std::shared_ptr<Object>> arg_list;
+    auto head = args;
+    while (head != nullptr) {
+        arg_list.push_back(head->get_value());
+        head = head->get_next();
+    }
+
+    Env temp_env(env);
+    CallableBindingGuard binding_guard;
+    if (arg_list.size() > func->get_params().size()) {
+        // Formatted lazily, which also keeps a stream out of this frame.
+        size_t expected = func->get_params().size(), got = arg_list.size();
+        throw EvalException([expected, got] {
+            return "different number of argument to function: expect " +
+                   std::to_string(expected) + ", but got " +
+                   std::to_string(got);
+        });
+    } else if (arg_list.size() == func->get_params().size()) {
+        auto syms = func->get_params().begin();
+        auto args = arg_list.begin();
+        while (syms != func->get_params().end()) {
+            auto value = eval(*args, env);
+            RETURN_IF_THROWING();
+            binding_guard.bind(value);
+            temp_env.set_obj((*syms)->get_symbol(), value);
+            syms++;
+            args++;
+        }
+    } else {
+        return make_object<PartiallyAppliedFunction>(func, args);
+    }
+
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    for (auto &body : func->get_body()) {
+        result = eval(body, temp_env);
+        RETURN_IF_THROWING();
+    }
+    return result;
+}
+
+std::shared_ptr<Object> eval_symbol(const std::shared_ptr<Symbol> &symbol,
+                                    Env &env) {
+    return env.get_obj(symbol->get_symbol());
+}
+
+// Auto parallelization of pure calls.
+//
+// With `--auto-parallel`, arguments of a call to a pure function are evaluated
+// on a thread pool when at least two of them are expensive. A function is
+// pure when its body doesn't call `set`, I/O or other impure functions. Tasks
+// never spawn tasks themselves, so waiting for them can't starve the pool.
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopping;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    ThreadPool(unsigned int size) : stopping(false) {
+        for (unsigned int i = 0; i < size; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    template <typename F>
+    std::future<decltype(std::declval<F>()())> submit(F f) {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back([task] { (*task)(); });
+        }
+        cond.notify_one();
+        return future;
+    }
+};
+
+ThreadPool &parallel_pool() {
+    static ThreadPool pool(PARALLEL_WORKERS);
+    return pool;
+}
+
+// Estimated cost from which an argument is worth evaluating on another thread.
+// A call to a user defined function always reaches it.
+const int PARALLEL_COST_THRESHOLD = 16;
+
+std::shared_ptr<Object> lookup_callee(const std::shared_ptr<Object> &head,
+                                      Env &env) {
+    if (head->kind() != ObjectKind::Symbol) {
+        return is_callable(head) ? head : nullptr;
+    }
+    auto value =
+        env.find(std::static_pointer_cast<Symbol>(head)->get_symbol());
+    return value != nullptr ? *value : nullptr;
+}
+
+bool is_pure_func(const std::shared_ptr<Function> &func, Env &env,
+                  std::set<const Function *> &visiting);
+
+bool is_pure_form(const std::shared_ptr<Object> &form, Env &env,
+                  const std::list<std::shared_ptr<Symbol>> &params,
+                  std::set<const Function *> &visiting);
+
+bool is_pure_backquoted(const std::shared_ptr<Object> &object, Env &env,
+                        const std::list<std::shared_ptr<Symbol>> &params,
+                        std::set<const Function *> &visiting) {
+    switch (object->kind()) {
+        case ObjectKind::Comma:
+            return is_pure_form(
+                std::static_pointer_cast<Comma>(object)->get_object(), env,
+                params, visiting);
+        case ObjectKind::CommaAtmark:
+            return is_pure_form(
+                std::static_pointer_cast<CommaAtmark>(object)->get_object(),
+                env, params, visiting);
+        case ObjectKind::Quoted:
+            return is_pure_backquoted(
+                std::static_pointer_cast<Quoted>(object)->get_object(), env,
+                params, visiting);
+        case ObjectKind::BackQuoted:
+            return is_pure_backquoted(
+                std::static_pointer_cast<BackQuoted>(object)->get_object(),
+                env, params, visiting);
+        case ObjectKind::List: {
+            auto it = std::static_pointer_cast<List>(object);
+            while (it != nullptr) {
+                if (!is_pure_backquoted(it->get_value(), env, params,
+                                        visiting)) {
+                    return false;
+                }
+                it = it->get_next();
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+// Callees which are parameters of the analysed function, or which can't be
+// resolved statically, make the form impure.
+bool is_pure_form(const std::shared_ptr<Object> &form, Env &env,
+                  const std::list<std::shared_ptr<Symbol>> &params,
+                  std::set<const Function *> &visiting) {
+    if (form->kind() == ObjectKind::BackQuoted) {
+        return is_pure_backquoted(
+            std::static_pointer_cast<BackQuoted>(form)->get_object(), env,
+            params, visiting);
+    } else if (form->kind() == ObjectKind::Comma ||
+               form->kind() == ObjectKind::CommaAtmark) {
+        return false;
+    } else if (form->kind() != ObjectKind::List) {
+        return true;
+    }
+
+    auto list = std::static_pointer_cast<List>(form);
+    auto head = list->get_value();
+    if (head->kind() == ObjectKind::Symbol) {
+        auto &name = std::static_pointer_cast<Symbol>(head)->get_symbol();
+        for (const auto &param : params) {
+            if (param->get_symbol() == name) {
+                return false;
+            }
+        }
+    }
+
+    auto callee = lookup_callee(head, env);
+    if (callee == nullptr) {
+        return false;
+    } else if (callee->kind() == ObjectKind::FuncPtr) {
+        auto purity = std::static_pointer_cast<FuncPtr>(callee)->get_purity();
+        if (purity == Purity::Impure) {
+            return false;
+        }
+    } else if (callee->kind() == ObjectKind::Function) {
+        auto func = std::static_pointer_cast<Function>(callee);
+        if (!is_pure_func(func, env, visiting)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    auto arg_it = list->get_next();
+    while (arg_it != nullptr) {
+        if (!is_pure_form(arg_it->get_value(), env, params, visiting)) {
+            return false;
+        }
+        arg_it = arg_it->get_next();
+    }
+    return true;
+}
+
+// Recursive calls are assumed pure while the function is being analysed, so
+// only results of outermost analyses and impure results are cached.
+bool is_pure_func(const std::shared_ptr<Function> &func, Env &env,
+                  std::set<const Function *> &visiting) {
+    const auto epoch = purity_epoch();
+    bool pure;
+    if (func->get_cached_purity(epoch, pure)) {
+        return pure;
+    }
+    if (!visiting.insert(func.get()).second) {
+        return true;
+    }
+
+    pure = true;
+    for (const auto &body : func->get_body()) {
+        if (!is_pure_form(body, env, func->get_params(), visiting)) {
+            pure = false;
+            break;
+        }
+    }
+
+    visiting.erase(func.get());
+    if (!pure || visiting.empty()) {
+        func->cache_purity(epoch, pure);
+    }
+    return pure;
+}
+
+int estimate_cost(const std::shared_ptr<Object> &form, Env &env) {
+    if (form->kind() != ObjectKind::List) {
+        return 0;
+    }
+
+    auto list = std::static_pointer_cast<List>(form);
+    auto callee = lookup_callee(list->get_value(), env);
+    if (callee != nullptr && callee->kind() == ObjectKind::Function) {
+        return PARALLEL_COST_THRESHOLD;
+    }
+
+    int cost = 1;
+    auto arg_it = list->get_next();
+    while (arg_it != nullptr && cost < PARALLEL_COST_THRESHOLD) {
+        cost += estimate_cost(arg_it->get_value(), env);
+        arg_it = arg_it->get_next();
+    }
+    return cost;
+}
+
+class ParallelTaskGuard {
+private:
+    bool saved;
+
+public:
+    ParallelTaskGuard() : saved(IN_PARALLEL_TASK) { IN_PARALLEL_TASK = true; }
+    ~ParallelTaskGuard() { IN_PARALLEL_TASK = saved; }
+};
+
+// Evaluates `args` on the thread pool ahead of the call to `callee` if the
+// call is pure and worth it. The values are returned quoted so the callee's
+// own evaluation of its arguments just unwraps them. Otherwise `args` is
+// returned as is.
+//
+// Limits are kept per thread, so arguments are evaluated in order while any
+// are active rather than on threads which would escape them.
+std::shared_ptr<List> eval_args_in_parallel(
+    const std::shared_ptr<Object> &callee, const std::shared_ptr<List> &args,
+    Env &env) {
+    if (args == nullptr || args->get_next() == nullptr || limits_active()) {
+        return args;
+    }
+
+    std::set<const Function *> visiting;
+    std::vector<std::shared_ptr<Object>> forms;
+    int expensive = 0;
+    auto arg_it = args;
+    while (arg_it != nullptr) {
+        auto form = arg_it->get_value();
+        if (!is_pure_form(form, env, {}, visiting)) {
+            return args;
+        }
+        if (estimate_cost(form, env) >= PARALLEL_COST_THRESHOLD) {
+            expensive++;
+        }
+        forms.push_back(form);
+        arg_it = arg_it->get_next();
+    }
+    if (expensive < 2) {
+        return args;
+    }
+
+    if (callee->kind() == ObjectKind::FuncPtr) {
+        auto func = std::static_pointer_cast<FuncPtr>(callee);
+        if (func->get_purity() != Purity::Strict) {
+            return args;
+        }
+    } else if (callee->kind() == ObjectKind::Function) {
+        auto func = std::static_pointer_cast<Function>(callee);
+        if (func->get_params().size() != forms.size() ||
+            !is_pure_func(func, env, visiting)) {
+            return args;
+        }
+    } else {
+        return args;
+    }
+
+    PARALLEL_CALLS.fetch_add(1, std::memory_order_relaxed);
+    ParallelTaskGuard guard;
+    std::vector<std::future<std::shared_ptr<Object>>> futures;
+    for (size_t i = 0; i + 1 < forms.size(); i++) {
+        auto form = forms[i];
+        futures.push_back(parallel_pool().submit([form, &env] {
+            ParallelTaskGuard guard;
+            return eval(form, env);
+        }));
+    }
+
+    // Every task refers to `env`, so all of them must finish before leaving
+    // even if one fails. The error of the leftmost argument wins.
+    std::vector<std::shared_ptr<Object>> values;
+    std::exception_ptr error;
+    std::shared_ptr<Object> last;
+    try {
+        last = eval(forms.back(), env);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    std::exception_ptr first_error;
+    for (auto &future : futures) {
+        try {
+            values.push_back(future.get());
+        } catch (...) {
+            if (!first_error) {
+                first_error = std::current_exception();
+            }
+        }
+    }
+    if (first_error) {
+        std::rethrow_exception(first_error);
+    } else if (error) {
+        std::rethrow_exception(error);
+    }
+    values.push_back(last);
+
+    auto quoted = make_object<List>(make_object<Quoted>(values[0]));
+    auto tail = quoted;
+    for (size_t i = 1; i < values.size(); i++) {
+        auto next = make_object<List>(make_object<Quoted>(values[i]));
+        tail->append(next);
+        tail = next;
+    }
+    return quoted;
+}
+
+std::shared_ptr<Object> fn_quote(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    TAKE_JUST_ONE_ARG("quote", args, a1);
+
+    return a1;
+}
+
+std::shared_ptr<Object> fn_list(const std::shared_ptr<List> args, Env &env) {
+    if (args == nullptr) {
+        return GLOBAL_NIL;
+    }
+
+    std::shared_ptr<Object> a1;
+    EVAL_ONE_ARG("list", args, env, a1);
+
+    auto list = make_object<List>(a1);
+    auto arg_it = args->get_next();
+    while (arg_it != nullptr) {
+        // HACK: When we append item to list, it takes O(len(list)).
+        //       The length increment if I append item. So, the time complexity
+        //       is O(1 + 2 + .. + n) = O(n^2), which is slow if number of item
+        //       is too big.
+        auto value = eval(arg_it->get_value(), env);
+        RETURN_IF_THROWING();
+        list->append(make_object<List>(value));
+        arg_it = arg_it->get_next();
+    }
+    return list;
+}
+
+std::shared_ptr<Object> fn_car(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("car", args, env, a1);
+
+    if (a1->kind() == ObjectKind::List) {
+        auto list = std::static_pointer_cast<List>(a1);
+        return list->get_value();
+    } else if (a1->kind() == ObjectKind::NIL) {
+        return a1;
+    } else {
+        throw EvalException([a1] { return a1->debug() + " is not a list"; });
+    }
+}
+
+std::shared_ptr<Object> fn_cdr(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("cdr", args, env, a1);
+
+    if (a1->kind() == ObjectKind::List) {
+        auto list = std::static_pointer_cast<List>(a1);
+        if (list->get_next() == nullptr) {
+            return GLOBAL_NIL;
+        } else {
+            return list->get_next();
+        }
+    } else if (a1->kind() == ObjectKind::NIL) {
+        return a1;
+    } else {
+        throw EvalException([a1] { return a1->debug() + " is not a list"; });
+    }
+}
+
+std::shared_ptr<Object> fn_cons(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("cons", args, env, a1, a2);
+
+    if (a2->kind() == ObjectKind::List) {
+        return make_object<List>(a1, std::static_pointer_cast<List>(a2));
+    } else {
+        std::shared_ptr<List> list = make_object<List>(a1);
+        list->append(make_object<List>(a2));
+        return list;
+    }
+}
+
+std::shared_ptr<Object> fn_rplaca(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("rplaca", args, env, a1, a2);
+
+    if (a1->kind() != ObjectKind::List) {
+        throw EvalException([a1] { return a1->debug() + " is not a cons"; });
+    }
+    std::static_pointer_cast<List>(a1)->set_value(a2);
+    return a1;
+}
+
+// Like `cons`, a non-list rest becomes a list of one element.
+std::shared_ptr<Object> fn_rplacd(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("rplacd", args, env, a1, a2);
+
+    if (a1->kind() != ObjectKind::List) {
+        throw EvalException([a1] { return a1->debug() + " is not a cons"; });
+    }
+    auto list = std::static_pointer_cast<List>(a1);
+    if (a2->kind() == ObjectKind::List) {
+        list->set_next(std::static_pointer_cast<List>(a2));
+    } else if (a2->kind() == ObjectKind::NIL) {
+        list->set_next(nullptr);
+    } else {
+        list->set_next(make_object<List>(a2));
+    }
+    return a1;
+}
+
+std::shared_ptr<Object> fn_atom(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("atom", args, env, a1);
+
+    if (a1->is_atom()) {
+        return GLOBAL_T;
+    } else {
+        return GLOBAL_NIL;
+    }
+}
+
+std::shared_ptr<Object> fn_if(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2, a3;
+    TAKE_JUST_THREE_ARG("if", args, a1, a2, a3);
+
+    a1 = eval(a1, env);
+    RETURN_IF_THROWING();
+    if (a1->kind() != ObjectKind::NIL) {
+        return eval(a2, env);
+    } else {
+        return eval(a3, env);
+    }
+}
+
+#define APPLY_COMP_OP_TO_NUMS(a1, a2, op)                                    \
+    do {                                                                     \
+        if (a1->kind() == ObjectKind::Integer &&                             \
+            a2->kind() == ObjectKind::Integer) {                             \
+            int l = std::static_pointer_cast<Integer>(a1)->get_integer();    \
+            int r = std::static_pointer_cast<Integer>(a2)->get_integer();    \
+            if (l op r) {                                                    \
+                return GLOBAL_T;                                             \
+            } else {                                                         \
+                return GLOBAL_NIL;                                           \
+            }                                                                \
+        } else if (a1->kind() == ObjectKind::Integer &&                      \
+                   a2->kind() == ObjectKind::Number) {                       \
+            double l = std::static_pointer_cast<Integer>(a1)->get_integer(); \
+            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
+            if (l op r) {                                                    \
+                return GLOBAL_T;                                             \
+            } else {                                                         \
+                return GLOBAL_NIL;                                           \
+            }                                                                \
+        } else if (a1->kind() == ObjectKind::Number &&                       \
+                   a2->kind() == ObjectKind::Integer) {                      \
+            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
+            double r = std::static_pointer_cast<Integer>(a2)->get_integer(); \
+            if (l op r) {                                                    \
+                return GLOBAL_T;                                             \
+            } else {                                                         \
+                return GLOBAL_NIL;                                           \
+            }                                                                \
+        } else if (a1->kind() == ObjectKind::Number &&                       \
+                   a2->kind() == ObjectKind::Number) {                       \
+            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
+            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
+            if (l op r) {                                                    \
+                return GLOBAL_T;                                             \
+            } else {                                                         \
+                return GLOBAL_NIL;                                           \
+            }                                                                \
+        } else {                                                             \
+            throw EvalException([a1, a2] {                                   \
+                std::ostringstream ss;                                       \
+                ss << std::string(#op)                                       \
+                   << " cannot be applied to non-numeric objects: ";         \
+                ss << "lhs is " << a1->debug() << " and rhs is "             \
+                   << a2->debug();                                           \
+                return ss.str();                                             \
+            });                                                              \
+        }                                                                    \
+    } while (0)
+
+#define APPLY_ARITH_OP_TO_NUMS(a1, a2, a3, op)                               \
+    do {                                                                     \
+        if (a1->kind() == ObjectKind::Integer &&                             \
+            a2->kind() == ObjectKind::Integer) {                             \
+            int l = std::static_pointer_cast<Integer>(a1)->get_integer();    \
+            int r = std::static_pointer_cast<Integer>(a2)->get_integer();    \
+            a3 = make_object<Integer>(l op r);                               \
+        } else if (a1->kind() == ObjectKind::Integer &&                      \
+                   a2->kind() == ObjectKind::Number) {                       \
+            double l = std::static_pointer_cast<Integer>(a1)->get_integer(); \
+            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
+            a3 = make_object<Number>(l op r);                                \
+        } else if (a1->kind() == ObjectKind::Number &&                       \
+                   a2->kind() == ObjectKind::Integer) {                      \
+            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
+            double r = std::static_pointer_cast<Integer>(a2)->get_integer(); \
+            a3 = make_object<Number>(l op r);                                \
+        } else if (a1->kind() == ObjectKind::Number &&                       \
+                   a2->kind() == ObjectKind::Number) {                       \
+            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
+            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
+            a3 = make_object<Number>(l op r);                                \
+        } else {                                                             \
+            throw EvalException([a1, a2] {                                   \
+                std::ostringstream ss;                                       \
+                ss << std::string(#op)                                       \
+                   << " cannot be applied to non-numeric objects: ";         \
+                ss << "lhs is " << a1->debug() << " and rhs is "             \
+                   << a2->debug();                                           \
+                return ss.str();                                             \
+            });                                                              \
+        }                                                                    \
+    } while (0)
+
+std::shared_ptr<Object> fn_eq_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, ==);
+}
+
+std::shared_ptr<Object> fn_ne_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("/=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, !=);
+}
+
+std::shared_ptr<Object> fn_lt_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("<", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, <);
+}
+
+std::shared_ptr<Object> fn_gt_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG(">", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, >);
+}
+
+std::shared_ptr<Object> fn_le_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("<=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, <=);
+}
+
+std::shared_ptr<Object> fn_ge_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG(">=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_NUMS(a1, a2, >=);
+}
+
+std::shared_ptr<Object> fn_add_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2, acc;
+    EVAL_TWO_ARG("+", args, env, a1, a2);
+    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, +);
+    auto head = args->get_next()->get_next();
+    while (head != nullptr) {
+        std::shared_ptr<Object> a;
+        EVAL_ONE_ARG("+", head, env, a);
+        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, +);
+        head = head->get_next();
+    }
+    return acc;
+}
+
+std::shared_ptr<Object> fn_sub_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2, acc;
+    EVAL_TWO_ARG("-", args, env, a1, a2);
+    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, -);
+    auto head = args->get_next()->get_next();
+    while (head != nullptr) {
+        std::shared_ptr<Object> a;
+        EVAL_ONE_ARG("-", head, env, a);
+        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, -);
+        head = head->get_next();
+    }
+    return acc;
+}
+
+std::shared_ptr<Object> fn_mul_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2, acc;
+    EVAL_TWO_ARG("*", args, env, a1, a2);
+    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, *);
+    auto head = args->get_next()->get_next();
+    while (head != nullptr) {
+        std::shared_ptr<Object> a;
+        EVAL_ONE_ARG("*", head, env, a);
+        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, *);
+        head = head->get_next();
+    }
+    return acc;
+}
+
+std::shared_ptr<Object> fn_div_num(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2, acc;
+    EVAL_TWO_ARG("/", args, env, a1, a2);
+    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, /);
+    auto head = args->get_next()->get_next();
+    while (head != nullptr) {
+        std::shared_ptr<Object> a;
+        EVAL_ONE_ARG("/", head, env, a);
+        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, /);
+        head = head->get_next();
+    }
+    return acc;
+}
+
+std::shared_ptr<Object> fn_string_nth(const std::shared_ptr<List> args,
+                                      Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_TWO_ARG("string-nth", args, env, a1, a2);
+    if (a1->kind() != ObjectKind::Integer) {
+        throw EvalException(
+            "first argument of string-nth must be evaluated to integer");
+    }
+    if (a2->kind() != ObjectKind::String) {
+        throw EvalException(
+            "second argument of string-nth must be evaluated to string");
+    }
+    auto index = std::static_pointer_cast<Integer>(a1)->get_integer();
+    auto string = std::static_pointer_cast<String>(a2)->get_string();
+    return make_object<String>(std::string(1, string.at(index)));
+}
+
+#define APPLY_COMP_OP_TO_STRS(name, a1, a2, op, ignore_upper_lower)        \
+    do {                                                                   \
+        if (a1->kind() == ObjectKind::String &&                            \
+            a2->kind() == ObjectKind::String) {                            \
+            auto l = std::static_pointer_cast<String>(a1) -> get_string(); \
+            auto r = std::static_pointer_cast<String>(a2) -> get_string(); \
+            if ((ignore_upper_lower)) {                                    \
+                std::transform(l.begin(), l.end(), l.begin(), tolower);    \
+                std::transform(r.begin(), r.end(), r.begin(), tolower);    \
+            }                                                              \
+            if (l op r) {                                                  \
+                return GLOBAL_T;                                           \
+            } else {                                                       \
+                return GLOBAL_NIL;                                         \
+            }                                                              \
+        } else {                                                           \
+            std::ostringstream ss;                                         \
+            ss << "arguments of " << name << " must be string";            \
+            throw EvalException(ss.str());                                 \
+        }                                                                  \
+    } while (0)
+
+std::shared_ptr<Object> fn_eq_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string=", a1, a2, ==, false);
+}
+
+std::shared_ptr<Object> fn_ne_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string/=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string/=", a1, a2, !=, false);
+}
+
+std::shared_ptr<Object> fn_lt_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string<", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string<", a1, a2, <, false);
+}
 
-std::shared_ptr<Object> eval(const std::shared_ptr<Object> &object, Env &env) {
-    switch (object->kind()) {
-        case ObjectKind::T:
-        case ObjectKind::NIL:
-        case ObjectKind::Integer:
-        case ObjectKind::Number:
-        case ObjectKind::String:
-        case ObjectKind::Function:
-        case ObjectKind::FuncPtr:
-        case ObjectKind::PartiallyAppliedFunction:
-        case ObjectKind::PartiallyAppliedFuncPtr:
-        case ObjectKind::Macro:
-            return object;
-        case ObjectKind::List:
-            return eval_list(std::static_pointer_cast<List>(object), env);
-        case ObjectKind::Symbol:
-            return eval_symbol(std::static_pointer_cast<Symbol>(object), env);
-        case ObjectKind::Quoted:
-            return std::static_pointer_cast<Quoted>(object)->get_object();
-        case ObjectKind::BackQuoted:
-            // TODO: This algorithm can't evaluate `(',@(list 10 20)) to ((quote
-            // 10 20)) like clisp does.
-            return eval_backquoted(
-                std::static_pointer_cast<BackQuoted>(object)->get_object(),
-                env);
-        case ObjectKind::Comma:
-        case ObjectKind::CommaAtmark:
-            throw EvalException("comma is invalid outside of backquote");
-        default:
-            throw EvalException("unreachable");
-    }
+std::shared_ptr<Object> fn_gt_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string>", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string>", a1, a2, >, false);
 }
 
-std::shared_ptr<Object> eval_backquoted(const std::shared_ptr<Object> &object,
-                                        Env &env) {
-    if (object->kind() == ObjectKind::Quoted) {
-        auto inner = std::static_pointer_cast<Quoted>(object)->get_object();
-        return eval_backquoted(inner, env);
-    } else if (object->kind() == ObjectKind::Comma) {
-        auto inner = std::static_pointer_cast<Comma>(object)->get_object();
-        return eval(inner, env);
-    } else if (object->kind() == ObjectKind::List) {
-        return eval_backquoted_list(std::static_pointer_cast<List>(object),
-                                    env);
-    } else {
-        return object;
-    }
+std::shared_ptr<Object> fn_le_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string<=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string<=", a1, a2, <=, false);
 }
 
-std::shared_ptr<Object> eval_backquoted_list(const std::shared_ptr<List> &list,
-                                             Env &env) {
-    std::list<std::shared_ptr<Object>> objs;
-    auto list_it = list;
-    while (list_it != nullptr) {
-        auto object = list_it->get_value();
-        if (object->kind() == ObjectKind::Comma) {
-            auto inner = std::static_pointer_cast<Comma>(object)->get_object();
-            objs.push_back(eval(inner, env));
-        } else if (object->kind() == ObjectKind::CommaAtmark) {
-            auto inner = eval(
-                std::static_pointer_cast<CommaAtmark>(object)->get_object(),
-                env);
-            if (inner->kind() == ObjectKind::List) {
-                auto inner_it = std::static_pointer_cast<List>(inner);
-                while (inner_it != nullptr) {
-                    objs.push_back(inner_it->get_value());
-                    inner_it = inner_it->get_next();
-                }
-            } else if (inner->kind() != ObjectKind::NIL) {
-                objs.push_back(inner);
-            }
-        } else if (object->kind() == ObjectKind::Quoted) {
-            auto inner = std::static_pointer_cast<Quoted>(object)->get_object();
-            objs.push_back(
-                std::make_shared<Quoted>(eval_backquoted(inner, env)));
-        } else if (object->kind() == ObjectKind::BackQuoted) {
-            auto inner =
-                std::static_pointer_cast<BackQuoted>(object)->get_object();
-            objs.push_back(
-                std::make_shared<BackQuoted>(eval_backquoted(inner, env)));
-        } else if (object->kind() == ObjectKind::List) {
-            objs.push_back(eval_backquoted_list(
-                std::static_pointer_cast<List>(object), env));
-        } else {
-            objs.push_back(object);
-        }
-        list_it = list_it->get_next();
-    }
+std::shared_ptr<Object> fn_ge_str(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string>=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string>=", a1, a2, >=, false);
+}
 
-    if (objs.empty()) {
-        return GLOBAL_NIL;
-    }
+std::shared_ptr<Object> fn_equal_str(const std::shared_ptr<List> args,
+                                     Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("string>=", args, env, a1, a2);
+    APPLY_COMP_OP_TO_STRS("string>=", a1, a2, >=, true);
+}
 
-    auto new_list = std::make_shared<List>(objs.front());
-    objs.pop_front();
-    while (!objs.empty()) {
-        new_list->append(std::make_shared<List>(objs.front()));
-        objs.pop_front();
+std::shared_ptr<Object> fn_write(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("write", args, env, a1);
+    if (a1->kind() == ObjectKind::String) {
+        *LISP_OUT << '"' << std::static_pointer_cast<String>(a1)->get_string()
+                  << '"';
+    } else if (a1->kind() == ObjectKind::Integer) {
+        *LISP_OUT << std::static_pointer_cast<Integer>(a1)->get_integer();
+    } else if (a1->kind() == ObjectKind::Number) {
+        *LISP_OUT << std::to_string(
+            std::static_pointer_cast<Number>(a1)->get_number());
+    } else {
+        throw EvalException("write can only accpet string, integer or number");
     }
-    return new_list;
+    return a1;
 }
 
-std::shared_ptr<Object> eval_list(const std::shared_ptr<List> &list, Env &env) {
-    auto first = eval(list->get_value(), env);
-    if (first->kind() == ObjectKind::Function) {
-        auto func = std::static_pointer_cast<Function>(first);
-        return apply_func(func, list->get_next(), env);
-    } else if (first->kind() == ObjectKind::FuncPtr) {
-        auto func = std::static_pointer_cast<FuncPtr>(first);
-        return apply_func_ptr(func, list->get_next(), env);
-    } else if (first->kind() == ObjectKind::PartiallyAppliedFunction) {
-        auto func = std::static_pointer_cast<PartiallyAppliedFunction>(first);
-        return apply_part_func(func, list->get_next(), env);
-    } else if (first->kind() == ObjectKind::PartiallyAppliedFuncPtr) {
-        auto func = std::static_pointer_cast<PartiallyAppliedFuncPtr>(first);
-        return apply_part_func_ptr(func, list->get_next(), env);
-    } else if (first->kind() == ObjectKind::Macro) {
-        auto macro = std::static_pointer_cast<Macro>(first);
-        return apply_macro(macro, list->get_next(), env);
+std::shared_ptr<Object> fn_write_line(const std::shared_ptr<List> args,
+                                      Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("write-line", args, env, a1);
+    if (a1->kind() == ObjectKind::String) {
+        *LISP_OUT << std::static_pointer_cast<String>(a1)->get_string()
+                  << std::endl;
     } else {
-        throw EvalException("first object of list must be function or symbol");
+        throw EvalException("write-line can only accpet string");
     }
+    return a1;
 }
 
-void assign_macro_sym(
-    std::list<std::shared_ptr<Symbol>>::iterator &sym_it,
-    const std::list<std::shared_ptr<Symbol>>::iterator &sym_last,
-    std::list<std::shared_ptr<Object>>::iterator &arg_it,
-    const std::list<std::shared_ptr<Object>>::iterator &arg_last, Env &env) {
-    if (sym_it == sym_last) {
-        throw EvalException("too many arguments for macro");
+std::shared_ptr<Object> fn_print(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("write", args, env, a1);
+    if (a1->kind() == ObjectKind::String) {
+        *LISP_OUT << std::endl
+                  << '"' << std::static_pointer_cast<String>(a1)->get_string()
+                  << '"';
+    } else if (a1->kind() == ObjectKind::Integer) {
+        *LISP_OUT << std::endl
+                  << std::static_pointer_cast<Integer>(a1)->get_integer();
+    } else if (a1->kind() == ObjectKind::Number) {
+        *LISP_OUT << std::endl
+                  << std::to_string(
+                         std::static_pointer_cast<Number>(a1)->get_number());
+    } else {
+        throw EvalException("print can only accpet string, integer or number");
     }
+    return a1;
+}
 
-    if ((*sym_it)->get_symbol() == "&body") {
-        sym_it++;
-        if (sym_it == sym_last) {
-            throw EvalException("symbol expected after &body");
-        }
-
-        if (arg_it == arg_last) {
-            env.set_obj((*sym_it++)->get_symbol(), GLOBAL_NIL);
-            return;
-        }
-
-        auto body_list = std::make_shared<List>(*arg_it++);
-        while (arg_it != arg_last) {
-            body_list->append(std::make_shared<List>(*arg_it++));
-        }
-
-        env.set_obj((*sym_it++)->get_symbol(), body_list);
-
-        if (sym_it != sym_last) {
-            throw EvalException("more than two symbol after &body is invalid");
-        }
-    } else if ((*sym_it)->get_symbol() == "&optional") {
-        sym_it++;
-        if (sym_it == sym_last) {
-            throw EvalException("symbol expected after &optional");
-        }
+std::shared_ptr<Object> fn_prin1(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("write", args, env, a1);
+    if (a1->kind() == ObjectKind::String) {
+        *LISP_OUT << '"' << std::static_pointer_cast<String>(a1)->get_string()
+                  << '"';
+    } else if (a1->kind() == ObjectKind::Integer) {
+        *LISP_OUT << std::static_pointer_cast<Integer>(a1)->get_integer();
+    } else if (a1->kind() == ObjectKind::Number) {
+        *LISP_OUT << std::to_string(
+            std::static_pointer_cast<Number>(a1)->get_number());
+    } else {
+        throw EvalException("prin1 can only accpet string, integer or number");
+    }
+    return a1;
+}
 
-        while (sym_it != sym_last) {
-            if (arg_it == arg_last) {
-                env.set_obj((*sym_it++)->get_symbol(), GLOBAL_NIL);
-            } else {
-                env.set_obj((*sym_it++)->get_symbol(), *arg_it++);
-            }
-        }
+std::shared_ptr<Object> fn_princ(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("write", args, env, a1);
+    if (a1->kind() == ObjectKind::String) {
+        *LISP_OUT << std::static_pointer_cast<String>(a1)->get_string();
+    } else if (a1->kind() == ObjectKind::Integer) {
+        *LISP_OUT << std::static_pointer_cast<Integer>(a1)->get_integer();
+    } else if (a1->kind() == ObjectKind::Number) {
+        *LISP_OUT << std::to_string(
+            std::static_pointer_cast<Number>(a1)->get_number());
     } else {
-        if (arg_it != arg_last) {
-            env.set_obj((*sym_it++)->get_symbol(), *arg_it++);
-        } else {
-            std::ostringstream ss;
-            ss << "no object correspond with " << (*sym_it)->get_symbol();
-            throw EvalException(ss.str());
-        }
+        throw EvalException("princ can only accpet string, integer or number");
     }
+    return a1;
 }
 
-std::list<std::shared_ptr<Object>> expand_macro(
-    const std::shared_ptr<Macro> macro, const std::shared_ptr<List> args,
-    Env &env) {
-    std::list<std::shared_ptr<Object>> arg_list;
-    auto head = args;
-    while (head != nullptr) {
-        arg_list.push_back(head->get_value());
-        head = head->get_next();
+std::shared_ptr<Object> fn_read_str(const std::shared_ptr<List> args,
+                                    Env &env) {
+    if (args != nullptr) {
+        throw EvalException("too many arguments for reads");
     }
 
-    Env temp_env(env);
-    auto sym_it = macro->get_params().begin();
-    const auto sym_last = macro->get_params().end();
-    auto arg_it = arg_list.begin();
-    const auto arg_last = arg_list.end();
-    while (sym_it != sym_last || arg_it != arg_last) {
-        assign_macro_sym(sym_it, sym_last, arg_it, arg_last, temp_env);
+    std::string s;
+    if (std::cin >> s) {
+        return make_object<String>(s);
+    } else {
+        throw EvalException("faild to read a string");
     }
+}
 
-    std::list<std::shared_ptr<Object>> list;
-    for (auto &body : macro->get_body()) {
-        list.push_back(eval(body, temp_env));
+std::shared_ptr<Object> fn_read_int(const std::shared_ptr<List> args,
+                                    Env &env) {
+    if (args != nullptr) {
+        throw EvalException("too many arguments for readi");
+    }
+
+    int i;
+    if (std::cin >> i) {
+        return make_object<Integer>(i);
+    } else {
+        throw EvalException("faild to read an integer");
     }
-    return list;
 }
 
-std::shared_ptr<Object> apply_macro(const std::shared_ptr<Macro> macro,
-                                    const std::shared_ptr<List> args,
+std::shared_ptr<Object> fn_read_num(const std::shared_ptr<List> args,
                                     Env &env) {
-    auto expanded_objs = expand_macro(macro, args, env);
-    std::shared_ptr<Object> result = GLOBAL_NIL;
-    for (auto &expanded_obj : expanded_objs) {
-        result = eval(expanded_obj, env);
+    if (args != nullptr) {
+        throw EvalException("too many arguments for readn");
     }
-    return result;
-}
 
-std::shared_ptr<Object> apply_part_func_ptr(
-    const std::shared_ptr<PartiallyAppliedFuncPtr> func,
-    const std::shared_ptr<List> args, Env &env) {
-    auto new_args = func->get_args();
-    new_args->append(args);
-    return apply_func_ptr(func->get_func(), new_args, env);
+    double n;
+    if (std::cin >> n) {
+        return make_object<Number>(n);
+    } else {
+        throw EvalException("faild to read a number");
+    }
 }
 
-std::shared_ptr<Object> apply_func_ptr(const std::shared_ptr<FuncPtr> func,
-                                       const std::shared_ptr<List> args,
-                                       Env &env) {
-    return func->get_func()(args, env);
-}
+std::shared_ptr<Object> fn_lambda(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    TAKE_ONE_ARG("lambda", args, a1);
 
-std::shared_ptr<Object> apply_part_func(
-    const std::shared_ptr<PartiallyAppliedFunction> func,
-    const std::shared_ptr<List> args, Env &env) {
-    auto new_args = func->get_args();
-    new_args->append(args);
-    return apply_func(func->get_func(), new_args, env);
-}
+    if (a1->kind() == ObjectKind::List) {
+        std::list<std::shared_ptr<Symbol>> lambda_args = {};
+        auto head = std::static_pointer_cast<List>(a1);
+        while (head != nullptr) {
+            auto obj = head->get_value();
+            if (obj->kind() != ObjectKind::Symbol) {
+                throw EvalException("list elements of lambda must be symbol");
+            } else {
+                lambda_args.push_back(std::static_pointer_cast<Symbol>(obj));
+                head = head->get_next();
+            }
+        }
 
-std::shared_ptr<Object> apply_func(const std::shared_ptr<Function> func,
-                                   const std::shared_ptr<List> args, Env &env) {
-    std::list<std::shared_ptr<Object>> arg_list;
-    auto head = args;
-    while (head != nullptr) {
-        arg_list.push_back(head->get_value());
-        head = head->get_next();
-    }
+        std::list<std::shared_ptr<Object>> lambda_body = {};
+        if (args->get_next() != nullptr) {
+            lambda_body = args->get_next()->to_list();
+        }
 
-    Env temp_env(env);
-    if (arg_list.size() > func->get_params().size()) {
-        std::ostringstream ss;
-        ss << "different number of argument to function: expect "
-           << func->get_params().size();
-        ss << ", but got " << arg_list.size();
-        throw EvalException(ss.str());
-    } else if (arg_list.size() == func->get_params().size()) {
-        auto syms = func->get_params().begin();
-        auto args = arg_list.begin();
-        while (syms != func->get_params().end()) {
-            temp_env.set_obj((*syms)->get_symbol(), eval(*args, env));
-            syms++;
-            args++;
+        return make_object<Function>(lambda_args, lambda_body);
+    } else if (a1->kind() == ObjectKind::NIL) {
+        std::list<std::shared_ptr<Object>> lambda_body = {};
+        if (args->get_next() != nullptr) {
+            lambda_body = args->get_next()->to_list();
         }
-    } else {
-        return std::make_shared<PartiallyAppliedFunction>(func, args);
-    }
 
-    std::shared_ptr<Object> result = GLOBAL_NIL;
-    for (auto &body : func->get_body()) {
-        result = eval(body, temp_env);
+        return make_object<Function>(std::list<std::shared_ptr<Symbol>>(),
+                                          lambda_body);
+    } else {
+        throw EvalException("first argument of lambda must be list");
     }
-    return result;
-}
-
-std::shared_ptr<Object> eval_symbol(const std::shared_ptr<Symbol> &symbol,
-                                    Env &env) {
-    return env.get_obj(symbol->get_symbol());
 }
 
-std::shared_ptr<Object> fn_quote(const std::shared_ptr<List> args, Env &env) {
+std::shared_ptr<Object> fn_macro(const std::shared_ptr<List> args, Env &env) {
     std::shared_ptr<Object> a1;
-    TAKE_JUST_ONE_ARG("quote", args, a1);
+    TAKE_ONE_ARG("macro", args, a1);
 
-    return a1;
-}
+    if (a1->kind() == ObjectKind::List) {
+        std::list<std::shared_ptr<Symbol>> macro_args = {};
+        auto head = std::static_pointer_cast<List>(a1);
+        while (head != nullptr) {
+            auto obj = head->get_value();
+            if (obj->kind() != ObjectKind::Symbol) {
+                throw EvalException("list elements of macro must be symbol");
+            } else {
+                macro_args.push_back(std::static_pointer_cast<Symbol>(obj));
+                head = head->get_next();
+            }
+        }
 
-std::shared_ptr<Object> fn_list(const std::shared_ptr<List> args, Env &env) {
-    if (args == nullptr) {
-        return GLOBAL_NIL;
+        std::list<std::shared_ptr<Object>> macro_body = {};
+        if (args->get_next() != nullptr) {
+            macro_body = args->get_next()->to_list();
+        }
+
+        return make_object<Macro>(macro_args, macro_body);
+    } else if (a1->kind() == ObjectKind::NIL) {
+        std::list<std::shared_ptr<Object>> macro_body = {};
+        if (args->get_next() != nullptr) {
+            macro_body = args->get_next()->to_list();
+        }
+
+        return make_object<Macro>(std::list<std::shared_ptr<Symbol>>(),
+                                       macro_body);
+    } else {
+        throw EvalException("first argument of macro must be list");
     }
+}
 
-    std::shared_ptr<Object> a1;
-    EVAL_ONE_ARG("list", args, env, a1);
+std::shared_ptr<Object> fn_set(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1, a2;
+    EVAL_JUST_TWO_ARG("set", args, env, a1, a2);
 
-    auto list = std::make_shared<List>(a1);
-    auto arg_it = args->get_next();
-    while (arg_it != nullptr) {
-        // HACK: When we append item to list, it takes O(len(list)).
-        //       The length increment if I append item. So, the time complexity
-        //       is O(1 + 2 + .. + n) = O(n^2), which is slow if number of item
-        //       is too big.
-        list->append(std::make_shared<List>(eval(arg_it->get_value(), env)));
-        arg_it = arg_it->get_next();
+    if (a1->kind() != ObjectKind::Symbol) {
+        throw EvalException("first argument of set must have symbol");
     }
-    return list;
+    auto name = std::static_pointer_cast<Symbol>(a1)->get_symbol();
+    if (is_callable(a2)) {
+        PURITY_EPOCH.fetch_add(1, std::memory_order_acq_rel);
+        name_callable(a2, name);
+    }
+    env.set_obj(name, a2);
+    return a2;
 }
 
-std::shared_ptr<Object> fn_car(const std::shared_ptr<List> args, Env &env) {
+std::shared_ptr<Object> fn_int_to_string(const std::shared_ptr<List> args,
+                                         Env &env) {
     std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("car", args, env, a1);
+    EVAL_JUST_ONE_ARG("int-to-string", args, env, a1);
 
-    if (a1->kind() == ObjectKind::List) {
-        auto list = std::static_pointer_cast<List>(a1);
-        return list->get_value();
-    } else if (a1->kind() == ObjectKind::NIL) {
-        return a1;
+    if (a1->kind() == ObjectKind::Integer) {
+        auto integer = std::static_pointer_cast<Integer>(a1)->get_integer();
+        return make_object<String>(std::to_string(integer));
     } else {
-        throw EvalException(a1->debug() + " is not a list");
+        throw EvalException("given object is not an integer");
     }
 }
 
-std::shared_ptr<Object> fn_cdr(const std::shared_ptr<List> args, Env &env) {
+std::shared_ptr<Object> fn_num_to_string(const std::shared_ptr<List> args,
+                                         Env &env) {
     std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("cdr", args, env, a1);
+    EVAL_JUST_ONE_ARG("num-to-string", args, env, a1);
 
-    if (a1->kind() == ObjectKind::List) {
-        auto list = std::static_pointer_cast<List>(a1);
-        if (list->get_next() == nullptr) {
-            return GLOBAL_NIL;
-        } else {
-            return list->get_next();
-        }
-    } else if (a1->kind() == ObjectKind::NIL) {
-        return a1;
+    if (a1->kind() == ObjectKind::Number) {
+        auto number = std::static_pointer_cast<Number>(a1)->get_number();
+        return make_object<String>(std::to_string(number));
     } else {
-        throw EvalException(a1->debug() + " is not a list");
+        throw EvalException("given object is not a number");
     }
 }
 
-std::shared_ptr<Object> fn_cons(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("cons", args, env, a1, a2);
+std::shared_ptr<Object> fn_debug(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("debug", args, env, a1);
+    return make_object<String>(a1->debug());
+}
 
-    if (a2->kind() == ObjectKind::List) {
-        return std::make_shared<List>(a1, std::static_pointer_cast<List>(a2));
+std::shared_ptr<Object> fn_type_of(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> a1;
+    EVAL_JUST_ONE_ARG("type-of", args, env, a1);
+
+    return make_object<String>(kind_name(a1->kind()));
+}
+
+std::shared_ptr<Object> fn_concat(const std::shared_ptr<List> args, Env &env) {
+    std::string acc;
+    std::shared_ptr<Object> a1, a2;
+    EVAL_TWO_ARG("concat", args, env, a1, a2);
+    if (a1->kind() == ObjectKind::String && a2->kind() == ObjectKind::String) {
+        acc = std::static_pointer_cast<String>(a1)->get_string() +
+              std::static_pointer_cast<String>(a2)->get_string();
     } else {
-        std::shared_ptr<List> list = std::make_shared<List>(a1);
-        list->append(std::make_shared<List>(a2));
-        return list;
+        throw EvalException("arguments of concat must be string");
+    }
+    auto head = args->get_next()->get_next();
+    while (head != nullptr) {
+        std::shared_ptr<Object> a;
+        EVAL_ONE_ARG("concat", head, env, a);
+        if (a->kind() == ObjectKind::String) {
+            acc += std::static_pointer_cast<String>(a)->get_string();
+        } else {
+            throw EvalException("arguments of concat must be string");
+        }
+        head = head->get_next();
     }
+    return make_object<String>(acc);
 }
 
-std::shared_ptr<Object> fn_atom(const std::shared_ptr<List> args, Env &env) {
+std::shared_ptr<Object> fn_macroexpand(const std::shared_ptr<List> args,
+                                       Env &env) {
     std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("atom", args, env, a1);
+    EVAL_ONE_ARG("macroexpand", args, env, a1);
 
-    if (a1->is_atom()) {
-        return GLOBAL_T;
+    if (a1->kind() != ObjectKind::List) {
+        throw EvalException(
+            "first argument of macroexpand must be evaluated to list");
+    }
+
+    auto list = std::static_pointer_cast<List>(a1);
+    if (list->get_value()->kind() == ObjectKind::Symbol) {
+        auto macro_name =
+            std::static_pointer_cast<Symbol>(list->get_value())->get_symbol();
+        auto maybe_macro = env.get_obj(macro_name);
+        if (maybe_macro->kind() != ObjectKind::Macro) {
+            throw EvalException("first element of list must hold macro");
+        }
+        auto macro = std::static_pointer_cast<Macro>(maybe_macro);
+        auto expanded = expand_macro(macro, list->get_next(), env);
+        if (expanded.empty()) {
+            return GLOBAL_NIL;
+        } else {
+            return *expanded.rbegin();
+        }
+    } else if (list->get_value()->kind() == ObjectKind::Macro) {
+        auto macro = std::static_pointer_cast<Macro>(list->get_value());
+        auto expanded = expand_macro(macro, list->get_next(), env);
+        if (expanded.empty()) {
+            return GLOBAL_NIL;
+        } else {
+            return *expanded.rbegin();
+        }
     } else {
-        return GLOBAL_NIL;
+        throw EvalException("first element of list must be symbol or macro");
+    }
+}
+
+std::shared_ptr<Object> fn_auto_parallel_count(
+    const std::shared_ptr<List> args, Env &env) {
+    if (args != nullptr) {
+        throw EvalException("too many arguments for auto-parallel-count");
     }
+    auto calls = PARALLEL_CALLS.load(std::memory_order_relaxed);
+    return make_object<Integer>(
+        static_cast<int>(std::min<uint64_t>(calls, INT_MAX)));
 }
 
-std::shared_ptr<Object> fn_if(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2, a3;
-    TAKE_JUST_THREE_ARG("if", args, a1, a2, a3);
-
-    if (eval(a1, env)->kind() != ObjectKind::NIL) {
-        return eval(a2, env);
-    } else {
-        return eval(a3, env);
+std::shared_ptr<Object> make_list(
+    const std::vector<std::shared_ptr<Object>> &objs) {
+    std::shared_ptr<List> head = nullptr;
+    for (auto it = objs.rbegin(); it != objs.rend(); it++) {
+        head = make_object<List>(*it, head);
+    }
+    if (head == nullptr) {
+        return GLOBAL_NIL;
     }
+    return head;
 }
 
-#define APPLY_COMP_OP_TO_NUMS(a1, a2, op)                                    \
-    do {                                                                     \
-        if (a1->kind() == ObjectKind::Integer &&                             \
-            a2->kind() == ObjectKind::Integer) {                             \
-            int l = std::static_pointer_cast<Integer>(a1)->get_integer();    \
-            int r = std::static_pointer_cast<Integer>(a2)->get_integer();    \
-            if (l op r) {                                                    \
-                return GLOBAL_T;                                             \
-            } else {                                                         \
-                return GLOBAL_NIL;                                           \
-            }                                                                \
-        } else if (a1->kind() == ObjectKind::Integer &&                      \
-                   a2->kind() == ObjectKind::Number) {                       \
-            double l = std::static_pointer_cast<Integer>(a1)->get_integer(); \
-            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
-            if (l op r) {                                                    \
-                return GLOBAL_T;                                             \
-            } else {                                                         \
-                return GLOBAL_NIL;                                           \
-            }                                                                \
-        } else if (a1->kind() == ObjectKind::Number &&                       \
-                   a2->kind() == ObjectKind::Integer) {                      \
-            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
-            double r = std::static_pointer_cast<Integer>(a2)->get_integer(); \
-            if (l op r) {                                                    \
-                return GLOBAL_T;                                             \
-            } else {                                                         \
-                return GLOBAL_NIL;                                           \
-            }                                                                \
-        } else if (a1->kind() == ObjectKind::Number &&                       \
-                   a2->kind() == ObjectKind::Number) {                       \
-            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
-            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
-            if (l op r) {                                                    \
-                return GLOBAL_T;                                             \
-            } else {                                                         \
-                return GLOBAL_NIL;                                           \
-            }                                                                \
-        } else {                                                             \
-            std::ostringstream ss;                                           \
-            ss << std::string(#op)                                           \
-               << " cannot be applied to non-numeric objects: ";             \
-            ss << "lhs is " << a1->debug() << " and rhs is " << a2->debug(); \
-            throw EvalException(ss.str());                                   \
-        }                                                                    \
-    } while (0)
+// Evaluates the body with the call profiler enabled, and returns the profile
+// of it as a list of (name calls inclusive-us exclusive-us allocations) by
+// decreasing exclusive time.
+std::shared_ptr<Object> fn_with_profiling(const std::shared_ptr<List> args,
+                                          Env &env) {
+    CallProfile profile;
+    CALL_PROFILER.swap_profile(profile);
+    auto previous = INSTRUMENTATION.fetch_or(INSTRUMENT_CALL_PROFILE);
+    auto restore = [&] {
+        if (!(previous & INSTRUMENT_CALL_PROFILE)) {
+            INSTRUMENTATION.fetch_and(~INSTRUMENT_CALL_PROFILE);
+        }
+        // Let enclosing profiles see these calls too.
+        CALL_PROFILER.swap_profile(profile);
+        CALL_PROFILER.merge_nested_profile(profile);
+    };
 
-#define APPLY_ARITH_OP_TO_NUMS(a1, a2, a3, op)                               \
-    do {                                                                     \
-        if (a1->kind() == ObjectKind::Integer &&                             \
-            a2->kind() == ObjectKind::Integer) {                             \
-            int l = std::static_pointer_cast<Integer>(a1)->get_integer();    \
-            int r = std::static_pointer_cast<Integer>(a2)->get_integer();    \
-            a3 = std::make_shared<Integer>(l op r);                          \
-        } else if (a1->kind() == ObjectKind::Integer &&                      \
-                   a2->kind() == ObjectKind::Number) {                       \
-            double l = std::static_pointer_cast<Integer>(a1)->get_integer(); \
-            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
-            a3 = std::make_shared<Number>(l op r);                           \
-        } else if (a1->kind() == ObjectKind::Number &&                       \
-                   a2->kind() == ObjectKind::Integer) {                      \
-            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
-            double r = std::static_pointer_cast<Integer>(a2)->get_integer(); \
-            a3 = std::make_shared<Number>(l op r);                           \
-        } else if (a1->kind() == ObjectKind::Number &&                       \
-                   a2->kind() == ObjectKind::Number) {                       \
-            double l = std::static_pointer_cast<Number>(a1)->get_number();   \
-            double r = std::static_pointer_cast<Number>(a2)->get_number();   \
-            a3 = std::make_shared<Number>(l op r);                           \
-        } else {                                                             \
-            std::ostringstream ss;                                           \
-            ss << std::string(#op)                                           \
-               << " cannot be applied to non-numeric objects: ";             \
-            ss << "lhs is " << a1->debug() << " and rhs is " << a2->debug(); \
-            throw EvalException(ss.str());                                   \
-        }                                                                    \
-    } while (0)
+    try {
+        auto head = args;
+        while (head != nullptr && !THROWING) {
+            eval(head->get_value(), env);
+            head = head->get_next();
+        }
+    } catch (...) {
+        restore();
+        throw;
+    }
+    restore();
+    RETURN_IF_THROWING();
 
-std::shared_ptr<Object> fn_eq_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, ==);
+    // Integers are ints, so the counts and times saturate.
+    auto saturated = [](uint64_t value) {
+        return make_object<Integer>(
+            static_cast<int>(std::min<uint64_t>(value, INT_MAX)));
+    };
+    std::vector<std::shared_ptr<Object>> entries;
+    for (const auto &entry : sort_call_profile(profile)) {
+        entries.push_back(make_list({
+            make_object<String>(entry.first),
+            saturated(entry.second.calls),
+            saturated(entry.second.inclusive_ns / 1000),
+            saturated(entry.second.exclusive_ns / 1000),
+            saturated(entry.second.allocations),
+        }));
+    }
+    return make_list(entries);
 }
 
-std::shared_ptr<Object> fn_ne_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("/=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, !=);
+std::shared_ptr<Object> fn_alloc_stats(const std::shared_ptr<List> args,
+                                       Env &env) {
+    if (args != nullptr) {
+        throw EvalException("too many arguments for alloc-stats");
+    }
+    print_alloc_stats(*LISP_OUT);
+    return GLOBAL_NIL;
 }
 
-std::shared_ptr<Object> fn_lt_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("<", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, <);
+// Prints the heap and the activity of the interpreter so far.
+void print_stats(std::ostream &os, const Env &env) {
+    ThreadCounters counters{};
+    collect_counters(counters);
+    print_kind_stats(os, counters);
+
+    size_t spans, span_bytes;
+    source_span_usage(spans, span_bytes);
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char line[512];
+    std::snprintf(line, sizeof(line),
+                  "bindings: %zu\n"
+                  "interned names: %zu\n"
+                  "source spans: %zu (%zu bytes)\n"
+                  "eval steps: %lu\n"
+                  "function calls: %lu\n"
+                  "macro expansions: %lu\n"
+                  "exceptions: %lu\n"
+                  "peak RSS: %ld kB\n",
+                  env.size(), interned_name_count(), spans, span_bytes,
+                  counters.eval_steps.load(), counters.calls.load(),
+                  counters.macro_expansions.load(),
+                  counters.exceptions.load(), usage.ru_maxrss);
+    os << line << std::flush;
 }
 
-std::shared_ptr<Object> fn_gt_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG(">", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, >);
+std::shared_ptr<Object> fn_room(const std::shared_ptr<List> args, Env &env) {
+    if (args != nullptr) {
+        throw EvalException("too many arguments for room");
+    }
+    print_stats(*LISP_OUT, env);
+    return GLOBAL_NIL;
 }
 
-std::shared_ptr<Object> fn_le_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("<=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, <=);
+// Bytes an object owns out of line, in addition to its allocation.
+size_t owned_bytes(Object *obj) {
+    switch (obj->kind()) {
+        case ObjectKind::String:
+            return string_buffer_bytes(
+                static_cast<String *>(obj)->get_string());
+        case ObjectKind::Symbol:
+            return string_buffer_bytes(
+                static_cast<Symbol *>(obj)->get_symbol());
+        case ObjectKind::Function: {
+            auto func = static_cast<Function *>(obj);
+            return (func->get_params().size() + func->get_body().size()) *
+                   LIST_NODE_BYTES;
+        }
+        case ObjectKind::Macro: {
+            auto macro = static_cast<Macro *>(obj);
+            return (macro->get_params().size() + macro->get_body().size()) *
+                   LIST_NODE_BYTES;
+        }
+        default:
+            return 0;
+    }
 }
 
-std::shared_ptr<Object> fn_ge_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG(">=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_NUMS(a1, a2, >=);
+// Name of functions, macros and buildins, or nullptr.
+const char *object_name(Object *obj) {
+    switch (obj->kind()) {
+        case ObjectKind::Function:
+            return static_cast<Function *>(obj)->get_name();
+        case ObjectKind::Macro:
+            return static_cast<Macro *>(obj)->get_name();
+        case ObjectKind::FuncPtr:
+            return static_cast<FuncPtr *>(obj)->get_name();
+        default:
+            return nullptr;
+    }
 }
 
-std::shared_ptr<Object> fn_add_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2, acc;
-    EVAL_TWO_ARG("+", args, env, a1, a2);
-    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, +);
-    auto head = args->get_next()->get_next();
-    while (head != nullptr) {
-        std::shared_ptr<Object> a;
-        EVAL_ONE_ARG("+", head, env, a);
-        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, +);
-        head = head->get_next();
+// Stores the bytes of an object of each kind, with its control block, to
+// `sizes`. Objects of a kind all have the same size.
+void object_sizes(size_t sizes[OBJECT_KIND_COUNT]) {
+    ThreadCounters counters{};
+    collect_counters(counters);
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        uint64_t allocated = counters.allocated[i];
+        sizes[i] = allocated != 0 ? counters.allocated_bytes[i] / allocated : 0;
     }
-    return acc;
 }
 
-std::shared_ptr<Object> fn_sub_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2, acc;
-    EVAL_TWO_ARG("-", args, env, a1, a2);
-    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, -);
-    auto head = args->get_next()->get_next();
-    while (head != nullptr) {
-        std::shared_ptr<Object> a;
-        EVAL_ONE_ARG("-", head, env, a);
-        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, -);
-        head = head->get_next();
+// Writes the objects reachable from the bindings of `env` and its outer
+// environments to `os`, one line each:
+//
+//     o ID KIND BYTES REF...     an object and the ids it references
+//     n ID NAME                  the name of a function, macro or buildin
+//     r ID NAME                  a binding, which is a root
+//     live OBJECTS BYTES         all live objects, reachable or not
+//
+// BYTES includes the control block and storage owned out of line. Objects
+// only referenced from the C++ stack, such as the form being evaluated, are
+// not reachable.
+void write_heap_snapshot(std::ostream &os, const Env &env) {
+    ThreadCounters counters{};
+    collect_counters(counters);
+    size_t kind_bytes[OBJECT_KIND_COUNT];
+    object_sizes(kind_bytes);
+    uint64_t live = 0, live_bytes = 0;
+    for (int i = 0; i < OBJECT_KIND_COUNT; i++) {
+        live += counters.allocated[i] - counters.freed[i];
+        live_bytes += counters.allocated_bytes[i] - counters.freed_bytes[i];
     }
-    return acc;
-}
 
-std::shared_ptr<Object> fn_mul_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2, acc;
-    EVAL_TWO_ARG("*", args, env, a1, a2);
-    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, *);
-    auto head = args->get_next()->get_next();
-    while (head != nullptr) {
-        std::shared_ptr<Object> a;
-        EVAL_ONE_ARG("*", head, env, a);
-        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, *);
-        head = head->get_next();
+    os << "mlisp-heap 1\n";
+    std::unordered_map<Object *, size_t> ids;
+    std::vector<Object *> pending;
+    auto id_of = [&](Object *obj) {
+        auto it = ids.find(obj);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        size_t id = ids.size() + 1;
+        ids.emplace(obj, id);
+        pending.push_back(obj);
+        return id;
+    };
+
+    // Inner bindings shadow outer ones.
+    std::unordered_set<std::string> seen;
+    for (const Env *e = &env; e != nullptr; e = e->get_outer().get()) {
+        e->for_each([&](const std::string &sym,
+                        const std::shared_ptr<Object> &obj) {
+            if (obj != nullptr && seen.insert(sym).second) {
+                os << "r " << id_of(obj.get()) << " " << sym << "\n";
+            }
+        });
     }
-    return acc;
+    os << "r " << id_of(GLOBAL_T.get()) << " T\n";
+    os << "r " << id_of(GLOBAL_NIL.get()) << " NIL\n";
+
+    // Lists can be too long to walk recursively.
+    std::vector<Object *> refs;
+    while (!pending.empty()) {
+        Object *obj = pending.back();
+        pending.pop_back();
+        refs.clear();
+        obj->references(refs);
+        os << "o " << ids[obj] << " " << kind_name(obj->kind()) << " "
+           << kind_bytes[static_cast<int>(obj->kind())] + owned_bytes(obj);
+        for (Object *ref : refs) {
+            os << " " << id_of(ref);
+        }
+        os << "\n";
+        if (const char *name = object_name(obj)) {
+            os << "n " << ids[obj] << " " << name << "\n";
+        }
+    }
+    os << "live " << live << " " << live_bytes << std::endl;
 }
 
-std::shared_ptr<Object> fn_div_num(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2, acc;
-    EVAL_TWO_ARG("/", args, env, a1, a2);
-    APPLY_ARITH_OP_TO_NUMS(a1, a2, acc, /);
-    auto head = args->get_next()->get_next();
-    while (head != nullptr) {
-        std::shared_ptr<Object> a;
-        EVAL_ONE_ARG("/", head, env, a);
-        APPLY_ARITH_OP_TO_NUMS(a, acc, acc, /);
-        head = head->get_next();
+bool dump_heap(const std::string &path, const Env &env) {
+    std::ofstream ofs(path);
+    if (!ofs) {
+        return false;
     }
-    return acc;
+    write_heap_snapshot(ofs, env);
+    return static_cast<bool>(ofs);
 }
 
-std::shared_ptr<Object> fn_string_nth(const std::shared_ptr<List> args,
-                                      Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_TWO_ARG("string-nth", args, env, a1, a2);
-    if (a1->kind() != ObjectKind::Integer) {
-        throw EvalException(
-            "first argument of string-nth must be evaluated to integer");
+std::shared_ptr<Object> fn_dump_heap(const std::shared_ptr<List> args,
+                                     Env &env) {
+    if (args == nullptr || args->get_next() != nullptr) {
+        throw EvalException("dump-heap takes a file name");
     }
-    if (a2->kind() != ObjectKind::String) {
-        throw EvalException(
-            "second argument of string-nth must be evaluated to string");
+    auto path = eval(args->get_value(), env);
+    RETURN_IF_THROWING();
+    if (path->kind() != ObjectKind::String) {
+        throw EvalException("file name of dump-heap must be a string");
     }
-    auto index = std::static_pointer_cast<Integer>(a1)->get_integer();
-    auto string = std::static_pointer_cast<String>(a2)->get_string();
-    return std::make_shared<String>(std::string(1, string.at(index)));
+    const std::string &file =
+        std::static_pointer_cast<String>(path)->get_string();
+    if (!dump_heap(file, env)) {
+        throw EvalException("faild to write heap snapshot to " + file);
+    }
+    return GLOBAL_T;
 }
 
-#define APPLY_COMP_OP_TO_STRS(name, a1, a2, op, ignore_upper_lower)        \
-    do {                                                                   \
-        if (a1->kind() == ObjectKind::String &&                            \
-            a2->kind() == ObjectKind::String) {                            \
-            auto l = std::static_pointer_cast<String>(a1) -> get_string(); \
-            auto r = std::static_pointer_cast<String>(a2) -> get_string(); \
-            if ((ignore_upper_lower)) {                                    \
-                std::transform(l.begin(), l.end(), l.begin(), tolower);    \
-                std::transform(r.begin(), r.end(), r.begin(), tolower);    \
-            }                                                              \
-            if (l op r) {                                                  \
-                return GLOBAL_T;                                           \
-            } else {                                                       \
-                return GLOBAL_NIL;                                         \
-            }                                                              \
-        } else {                                                           \
-            std::ostringstream ss;                                         \
-            ss << "arguments of " << name << " must be string";            \
-            throw EvalException(ss.str());                                 \
-        }                                                                  \
-    } while (0)
-
-std::shared_ptr<Object> fn_eq_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string=", a1, a2, ==, false);
+// Cycle detector.
+//
+// While TRACK_CONTAINERS is set, make_object registers every container. A
+// scan does trial deletion: it subtracts the references containers hold to
+// each other from their reference counts, so that what remains counts
+// references from elsewhere, like environments or the C++ stack. Containers
+// left with none, which no such container reaches either, are only kept
+// alive by cycles among themselves. Scans must not run while other threads
+// evaluate.
+
+static std::mutex TRACKED_MUTEX;
+// Expired entries keep the memory of their objects until they are purged,
+// which happens whenever the registry doubled and on every scan.
+static std::vector<std::pair<Object *, std::weak_ptr<Object>>> TRACKED;
+static size_t TRACKED_PURGE_SIZE = 1024;
+
+// Must be called with TRACKED_MUTEX held.
+void purge_tracked() {
+    TRACKED.erase(
+        std::remove_if(TRACKED.begin(), TRACKED.end(),
+                       [](const std::pair<Object *, std::weak_ptr<Object>>
+                              &entry) { return entry.second.expired(); }),
+        TRACKED.end());
+    TRACKED_PURGE_SIZE = std::max<size_t>(1024, TRACKED.size() * 2);
 }
 
-std::shared_ptr<Object> fn_ne_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string/=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string/=", a1, a2, !=, false);
+void track_container(const std::shared_ptr<Object> &obj) {
+    std::lock_guard<std::mutex> lock(TRACKED_MUTEX);
+    if (TRACKED.size() >= TRACKED_PURGE_SIZE) {
+        purge_tracked();
+    }
+    TRACKED.emplace_back(obj.get(), obj);
 }
 
-std::shared_ptr<Object> fn_lt_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string<", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string<", a1, a2, <, false);
-}
+// Scans every CYCLE_CHECK_INTERVAL top level forms if positive, and breaks
+// the cycles found if BREAK_CYCLES.
+static long CYCLE_CHECK_INTERVAL = 0;
+static bool BREAK_CYCLES = false;
+
+// Finds the containers only kept alive by cycles, reports them by connected
+// component to `os` and breaks them if `break_cycles`. Returns the number of
+// objects found.
+size_t collect_cycles(std::ostream &os, bool break_cycles) {
+    std::lock_guard<std::mutex> lock(TRACKED_MUTEX);
+    purge_tracked();
+
+    std::unordered_map<Object *, long> external;
+    for (const auto &entry : TRACKED) {
+        external[entry.first] = entry.second.use_count();
+    }
+    std::vector<Object *> refs;
+    for (const auto &entry : TRACKED) {
+        refs.clear();
+        entry.first->references(refs);
+        for (Object *ref : refs) {
+            auto it = external.find(ref);
+            if (it != external.end()) {
+                it->second--;
+            }
+        }
+    }
 
-std::shared_ptr<Object> fn_gt_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string>", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string>", a1, a2, >, false);
-}
+    // Whatever is referenced from elsewhere, and what it reaches, is alive.
+    std::unordered_set<Object *> alive;
+    std::vector<Object *> pending;
+    for (const auto &count : external) {
+        if (count.second > 0) {
+            pending.push_back(count.first);
+        }
+    }
+    while (!pending.empty()) {
+        Object *obj = pending.back();
+        pending.pop_back();
+        if (!alive.insert(obj).second) {
+            continue;
+        }
+        refs.clear();
+        obj->references(refs);
+        for (Object *ref : refs) {
+            if (external.count(ref) != 0 && alive.count(ref) == 0) {
+                pending.push_back(ref);
+            }
+        }
+    }
 
-std::shared_ptr<Object> fn_le_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string<=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string<=", a1, a2, <=, false);
+    // Groups the rest into connected components with union find.
+    std::unordered_map<Object *, Object *> parent;
+    for (const auto &entry : TRACKED) {
+        if (alive.count(entry.first) == 0) {
+            parent[entry.first] = entry.first;
+        }
+    }
+    if (parent.empty()) {
+        return 0;
+    }
+    auto find = [&](Object *obj) {
+        while (parent[obj] != obj) {
+            obj = parent[obj] = parent[parent[obj]];
+        }
+        return obj;
+    };
+    for (const auto &member : parent) {
+        refs.clear();
+        member.first->references(refs);
+        for (Object *ref : refs) {
+            if (parent.count(ref) != 0) {
+                parent[find(ref)] = find(member.first);
+            }
+        }
+    }
+
+    size_t sizes[OBJECT_KIND_COUNT];
+    object_sizes(sizes);
+    struct Cycle {
+        size_t objects = 0;
+        size_t bytes = 0;
+        std::map<std::string, size_t> kinds;
+    };
+    std::unordered_map<Object *, Cycle> cycles;
+    size_t bytes = 0;
+    for (const auto &member : parent) {
+        Cycle &cycle = cycles[find(member.first)];
+        size_t size = sizes[static_cast<int>(member.first->kind())] +
+                      owned_bytes(member.first);
+        cycle.objects++;
+        cycle.bytes += size;
+        cycle.kinds[kind_name(member.first->kind())]++;
+        bytes += size;
+    }
+    std::vector<const Cycle *> sorted;
+    for (const auto &cycle : cycles) {
+        sorted.push_back(&cycle.second);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Cycle *a, const Cycle *b) {
+        return a->bytes > b->bytes;
+    });
+
+    os << "leaked cycles: " << cycles.size() << " with " << parent.size()
+       << " objects, " << bytes << " bytes"
+       << (break_cycles ? ", broken" : "") << "\n";
+    const size_t max_cycles = 20;
+    for (size_t i = 0; i < sorted.size() && i < max_cycles; i++) {
+        os << "  " << sorted[i]->objects << " objects, " << sorted[i]->bytes
+           << " bytes:";
+        for (const auto &kind : sorted[i]->kinds) {
+            os << " " << kind.first << " " << kind.second;
+        }
+        os << "\n";
+    }
+    if (sorted.size() > max_cycles) {
+        os << "  and " << sorted.size() - max_cycles << " more\n";
+    }
+    os << std::flush;
+
+    if (break_cycles) {
+        // Holds every member until all references are cleared, so that none
+        // is freed while others still point to it.
+        std::vector<std::shared_ptr<Object>> members;
+        for (const auto &entry : TRACKED) {
+            if (parent.count(entry.first) != 0) {
+                members.push_back(entry.second.lock());
+            }
+        }
+        for (const auto &member : members) {
+            member->clear_references();
+        }
+    }
+    return parent.size();
 }
 
-std::shared_ptr<Object> fn_ge_str(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string>=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string>=", a1, a2, >=, false);
+std::shared_ptr<Object> fn_collect_cycles(const std::shared_ptr<List> args,
+                                          Env &env) {
+    if (args != nullptr && args->get_next() != nullptr) {
+        throw EvalException("too many arguments for collect-cycles");
+    }
+    if (!TRACK_CONTAINERS) {
+        throw EvalException(
+            "collect-cycles needs --cycle-check to track containers");
+    }
+    bool break_cycles =
+        args != nullptr && eval(args->get_value(), env) != GLOBAL_NIL;
+    RETURN_IF_THROWING();
+    size_t found = collect_cycles(*LISP_ERR, break_cycles);
+    return make_object<Integer>(static_cast<int>(found));
 }
 
-std::shared_ptr<Object> fn_equal_str(const std::shared_ptr<List> args,
-                                     Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("string>=", args, env, a1, a2);
-    APPLY_COMP_OP_TO_STRS("string>=", a1, a2, >=, true);
-}
+// File the heap is dumped to on SIGUSR2, or empty.
+static std::string HEAP_DUMP_PATH;
+static volatile sig_atomic_t HEAP_DUMP_REQUESTED = 0;
 
-std::shared_ptr<Object> fn_write(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("write", args, env, a1);
-    if (a1->kind() == ObjectKind::String) {
-        std::cout << '"' << std::static_pointer_cast<String>(a1)->get_string()
-                  << '"';
-    } else if (a1->kind() == ObjectKind::Integer) {
-        std::cout << std::static_pointer_cast<Integer>(a1)->get_integer();
-    } else if (a1->kind() == ObjectKind::Number) {
-        std::cout << std::to_string(
-            std::static_pointer_cast<Number>(a1)->get_number());
-    } else {
-        throw EvalException("write can only accpet string, integer or number");
-    }
-    return a1;
-}
+void request_heap_dump(int) { HEAP_DUMP_REQUESTED = 1; }
 
-std::shared_ptr<Object> fn_write_line(const std::shared_ptr<List> args,
-                                      Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("write-line", args, env, a1);
-    if (a1->kind() == ObjectKind::String) {
-        std::cout << std::static_pointer_cast<String>(a1)->get_string()
-                  << std::endl;
-    } else {
-        throw EvalException("write-line can only accpet string");
-    }
-    return a1;
+// Dumps the heap on SIGUSR2, once the current form has finished.
+void install_heap_dump_handler() {
+    struct sigaction sa = {};
+    sa.sa_handler = request_heap_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, nullptr);
 }
 
-std::shared_ptr<Object> fn_print(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("write", args, env, a1);
-    if (a1->kind() == ObjectKind::String) {
-        std::cout << std::endl
-                  << '"' << std::static_pointer_cast<String>(a1)->get_string()
-                  << '"';
-    } else if (a1->kind() == ObjectKind::Integer) {
-        std::cout << std::endl
-                  << std::static_pointer_cast<Integer>(a1)->get_integer();
-    } else if (a1->kind() == ObjectKind::Number) {
-        std::cout << std::endl
-                  << std::to_string(
-                         std::static_pointer_cast<Number>(a1)->get_number());
-    } else {
-        throw EvalException("print can only accpet string, integer or number");
-    }
-    return a1;
+double cpu_ms(const timeval &tv) {
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
 }
 
-std::shared_ptr<Object> fn_prin1(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("write", args, env, a1);
-    if (a1->kind() == ObjectKind::String) {
-        std::cout << '"' << std::static_pointer_cast<String>(a1)->get_string()
-                  << '"';
-    } else if (a1->kind() == ObjectKind::Integer) {
-        std::cout << std::static_pointer_cast<Integer>(a1)->get_integer();
-    } else if (a1->kind() == ObjectKind::Number) {
-        std::cout << std::to_string(
-            std::static_pointer_cast<Number>(a1)->get_number());
-    } else {
-        throw EvalException("prin1 can only accpet string, integer or number");
+// Evaluates the argument and prints the time and the resources spent on it.
+std::shared_ptr<Object> fn_time(const std::shared_ptr<List> args, Env &env) {
+    if (args == nullptr || args->get_next() != nullptr) {
+        throw EvalException("time needs just one argument");
     }
-    return a1;
+    // Only the calling thread is counted, so that batch scripts and server
+    // requests running alongside don't show up in each other's times.
+    ThreadCounters before{}, after{};
+    rusage usage_before, usage_after;
+    add_counters(before, thread_counters());
+    getrusage(RUSAGE_THREAD, &usage_before);
+    auto start = std::chrono::steady_clock::now();
+
+    auto result = eval(args->get_value(), env);
+    RETURN_IF_THROWING();
+
+    auto end = std::chrono::steady_clock::now();
+    getrusage(RUSAGE_THREAD, &usage_after);
+    add_counters(after, thread_counters());
+
+    char line[256];
+    std::snprintf(
+        line, sizeof(line),
+        "real time: %.3f ms\n"
+        "user time: %.3f ms\n"
+        "system time: %.3f ms\n"
+        "allocated: %lu bytes in %lu objects\n"
+        "eval steps: %lu\n"
+        "function calls: %lu\n",
+        std::chrono::duration<double, std::milli>(end - start).count(),
+        cpu_ms(usage_after.ru_utime) - cpu_ms(usage_before.ru_utime),
+        cpu_ms(usage_after.ru_stime) - cpu_ms(usage_before.ru_stime),
+        total_allocated(after, true) - total_allocated(before, true),
+        total_allocated(after, false) - total_allocated(before, false),
+        after.eval_steps - before.eval_steps, after.calls - before.calls);
+    *LISP_ERR << line << std::flush;
+    return result;
 }
 
-std::shared_ptr<Object> fn_princ(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("write", args, env, a1);
-    if (a1->kind() == ObjectKind::String) {
-        std::cout << std::static_pointer_cast<String>(a1)->get_string();
-    } else if (a1->kind() == ObjectKind::Integer) {
-        std::cout << std::static_pointer_cast<Integer>(a1)->get_integer();
-    } else if (a1->kind() == ObjectKind::Number) {
-        std::cout << std::to_string(
-            std::static_pointer_cast<Number>(a1)->get_number());
-    } else {
-        throw EvalException("princ can only accpet string, integer or number");
+// Evaluates the body and prints the hardware counters over it.
+std::shared_ptr<Object> fn_with_counters(const std::shared_ptr<List> args,
+                                         Env &env) {
+    PerfCounters counters;
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    counters.start();
+    auto head = args;
+    while (head != nullptr) {
+        result = eval(head->get_value(), env);
+        RETURN_IF_THROWING();
+        head = head->get_next();
     }
-    return a1;
+    counters.stop();
+    counters.report(*LISP_ERR);
+    return result;
 }
 
-std::shared_ptr<Object> fn_read_str(const std::shared_ptr<List> args,
-                                    Env &env) {
+static const auto START_TIME = std::chrono::steady_clock::now();
+
+// Milliseconds since the interpreter started.
+std::shared_ptr<Object> fn_get_internal_real_time(
+    const std::shared_ptr<List> args, Env &env) {
     if (args != nullptr) {
-        throw EvalException("too many arguments for reads");
+        throw EvalException("too many arguments for get-internal-real-time");
     }
+    return make_object<Integer>(static_cast<int>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - START_TIME)
+            .count()));
+}
 
-    std::string s;
-    if (std::cin >> s) {
-        return std::make_shared<String>(s);
-    } else {
-        throw EvalException("faild to read a string");
+// Evaluates the body, failing any allocation which would leave the objects
+// allocated in it taking more than the given bytes.
+std::shared_ptr<Object> fn_with_memory_limit(const std::shared_ptr<List> args,
+                                             Env &env) {
+    if (args == nullptr) {
+        throw EvalException("too few arguments for with-memory-limit");
+    }
+    auto limit = eval(args->get_value(), env);
+    RETURN_IF_THROWING();
+    if (limit->kind() != ObjectKind::Integer ||
+        std::static_pointer_cast<Integer>(limit)->get_integer() < 0) {
+        throw EvalException(
+            "memory limit of with-memory-limit must be a non-negative "
+            "integer");
     }
+    HeapBudget budget(std::static_pointer_cast<Integer>(limit)->get_integer());
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    auto head = args->get_next();
+    while (head != nullptr) {
+        result = eval(head->get_value(), env);
+        RETURN_IF_THROWING();
+        head = head->get_next();
+    }
+    return result;
 }
 
-std::shared_ptr<Object> fn_read_int(const std::shared_ptr<List> args,
-                                    Env &env) {
-    if (args != nullptr) {
-        throw EvalException("too many arguments for readi");
+// Evaluates the body within limits given as (:steps N :ms T), either of
+// which may be left out.
+std::shared_ptr<Object> fn_with_limits(const std::shared_ptr<List> args,
+                                       Env &env) {
+    if (args == nullptr) {
+        throw EvalException("too few arguments for with-limits");
+    }
+    long steps = -1, ms = -1;
+    auto spec = args->get_value();
+    if (spec->kind() == ObjectKind::List) {
+        auto it = std::static_pointer_cast<List>(spec);
+        while (it != nullptr) {
+            auto key = it->get_value();
+            if (key->kind() != ObjectKind::Symbol ||
+                it->get_next() == nullptr) {
+                throw EvalException(
+                    "limits of with-limits must be pairs of a keyword and a "
+                    "value");
+            }
+            auto value = eval(it->get_next()->get_value(), env);
+            RETURN_IF_THROWING();
+            if (value->kind() != ObjectKind::Integer ||
+                std::static_pointer_cast<Integer>(value)->get_integer() < 0) {
+                throw EvalException(
+                    "limits of with-limits must be non-negative integers");
+            }
+            long limit =
+                std::static_pointer_cast<Integer>(value)->get_integer();
+            const auto &name =
+                std::static_pointer_cast<Symbol>(key)->get_symbol();
+            if (name == ":steps") {
+                steps = limit;
+            } else if (name == ":ms") {
+                ms = limit;
+            } else {
+                throw EvalException("unknown limit of with-limits: " + name);
+            }
+            it = it->get_next()->get_next();
+        }
+    } else if (spec != GLOBAL_NIL) {
+        throw EvalException("limits of with-limits must be a list");
     }
 
-    int i;
-    if (std::cin >> i) {
-        return std::make_shared<Integer>(i);
-    } else {
-        throw EvalException("faild to read an integer");
+    return eval_with_limits(env, steps, ms, [&] {
+        std::shared_ptr<Object> result = GLOBAL_NIL;
+        auto head = args->get_next();
+        while (head != nullptr && !THROWING) {
+            result = eval(head->get_value(), env);
+            head = head->get_next();
+        }
+        return result;
+    });
+}
+
+// Non-local exits.
+//
+// `throw` returns to its `catch` by setting THROWING, which every caller
+// checks after evaluating a form, rather than by unwinding the C++ stack,
+// which costs more than a microsecond per frame. `throw` checks that a
+// matching `catch` is active first, and raises an ordinary error otherwise,
+// so a throw never reaches the top level.
+
+// Tags of the active catches of this thread, innermost last.
+static thread_local std::vector<std::shared_ptr<Object>> CATCH_TAGS;
+
+// Catch tags match when they are the same object, symbols of the same name or
+// equal integers.
+bool same_tag(const std::shared_ptr<Object> &a,
+              const std::shared_ptr<Object> &b) {
+    if (a == b) {
+        return true;
+    } else if (a->kind() != b->kind()) {
+        return false;
+    } else if (a->kind() == ObjectKind::Symbol) {
+        return std::static_pointer_cast<Symbol>(a)->get_symbol() ==
+               std::static_pointer_cast<Symbol>(b)->get_symbol();
+    } else if (a->kind() == ObjectKind::Integer) {
+        return std::static_pointer_cast<Integer>(a)->get_integer() ==
+               std::static_pointer_cast<Integer>(b)->get_integer();
     }
+    return false;
 }
 
-std::shared_ptr<Object> fn_read_num(const std::shared_ptr<List> args,
-                                    Env &env) {
-    if (args != nullptr) {
-        throw EvalException("too many arguments for readn");
+class CatchFrame {
+public:
+    CatchFrame(const std::shared_ptr<Object> &tag) {
+        CATCH_TAGS.push_back(tag);
     }
+    ~CatchFrame() {
+        CATCH_TAGS.pop_back();
+        // An error raised while a throw returned can leave THROWING set, and
+        // no throw is left once the outermost catch is gone.
+        if (CATCH_TAGS.empty() && THROWING) {
+            THROWING = false;
+            THROWN_TAG = nullptr;
+            THROWN_VALUE = nullptr;
+        }
+    }
+};
 
-    double n;
-    if (std::cin >> n) {
-        return std::make_shared<Number>(n);
-    } else {
-        throw EvalException("faild to read a number");
+// Evaluates the body and returns its last value, or the value thrown to the
+// tag within it.
+std::shared_ptr<Object> fn_catch(const std::shared_ptr<List> args, Env &env) {
+    if (args == nullptr) {
+        throw EvalException("too few arguments for catch");
     }
+    auto tag = eval(args->get_value(), env);
+    RETURN_IF_THROWING();
+    CatchFrame frame(tag);
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    auto head = args->get_next();
+    while (head != nullptr) {
+        result = eval(head->get_value(), env);
+        if (THROWING) {
+            if (!same_tag(THROWN_TAG, tag)) {
+                return GLOBAL_NIL;
+            }
+            THROWING = false;
+            THROWN_TAG = nullptr;
+            return std::move(THROWN_VALUE);
+        }
+        head = head->get_next();
+    }
+    return result;
 }
 
-std::shared_ptr<Object> fn_lambda(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    TAKE_ONE_ARG("lambda", args, a1);
+std::shared_ptr<Object> fn_throw(const std::shared_ptr<List> args, Env &env) {
+    std::shared_ptr<Object> tag, value;
+    EVAL_JUST_TWO_ARG("throw", args, env, tag, value);
 
-    if (a1->kind() == ObjectKind::List) {
-        std::list<std::shared_ptr<Symbol>> lambda_args = {};
-        auto head = std::static_pointer_cast<List>(a1);
-        while (head != nullptr) {
-            auto obj = head->get_value();
-            if (obj->kind() != ObjectKind::Symbol) {
-                throw EvalException("list elements of lambda must be symbol");
-            } else {
-                lambda_args.push_back(std::static_pointer_cast<Symbol>(obj));
-                head = head->get_next();
-            }
+    for (const auto &active : CATCH_TAGS) {
+        if (same_tag(active, tag)) {
+            THROWING = true;
+            THROWN_TAG = tag;
+            THROWN_VALUE = value;
+            return GLOBAL_NIL;
         }
+    }
+    throw EvalException([tag] { return "no catch for tag " + tag->debug(); });
+}
 
-        std::list<std::shared_ptr<Object>> lambda_body = {};
-        if (args->get_next() != nullptr) {
-            lambda_body = args->get_next()->to_list();
+// Evaluates the form, and if it raises an error, the body of the clause
+// (error (VAR) body...) instead. VAR is bound to the message of the error,
+// which is only formatted when a clause names one. A step or time limit which
+// was set outside the form and ran out isn't handled, so that sandboxed code
+// can't outlive its limits.
+std::shared_ptr<Object> fn_handler_case(const std::shared_ptr<List> args,
+                                        Env &env) {
+    if (args == nullptr) {
+        throw EvalException("too few arguments for handler-case");
+    }
+    bool has_clause = false;
+    std::shared_ptr<List> handler;
+    std::shared_ptr<Symbol> var;
+    for (auto it = args->get_next(); it != nullptr; it = it->get_next()) {
+        auto clause = it->get_value();
+        if (clause->kind() != ObjectKind::List ||
+            std::static_pointer_cast<List>(clause)->get_next() == nullptr) {
+            throw EvalException("clauses of handler-case must be lists");
         }
-
-        return std::make_shared<Function>(lambda_args, lambda_body);
-    } else if (a1->kind() == ObjectKind::NIL) {
-        std::list<std::shared_ptr<Object>> lambda_body = {};
-        if (args->get_next() != nullptr) {
-            lambda_body = args->get_next()->to_list();
+        auto type = std::static_pointer_cast<List>(clause)->get_value();
+        auto vars = std::static_pointer_cast<List>(clause)->get_next();
+        if (type->kind() != ObjectKind::Symbol ||
+            std::static_pointer_cast<Symbol>(type)->get_symbol() != "error") {
+            throw EvalException("unknown condition type of handler-case: " +
+                                type->debug());
+        }
+        auto params = vars->get_value();
+        std::shared_ptr<Symbol> param;
+        if (params->kind() == ObjectKind::List &&
+            std::static_pointer_cast<List>(params)->get_next() == nullptr &&
+            std::static_pointer_cast<List>(params)->get_value()->kind() ==
+                ObjectKind::Symbol) {
+            param = std::static_pointer_cast<Symbol>(
+                std::static_pointer_cast<List>(params)->get_value());
+        } else if (params != GLOBAL_NIL) {
+            throw EvalException(
+                "handler-case clause must bind at most one variable");
         }
+        if (!has_clause) {
+            has_clause = true;
+            handler = vars->get_next();
+            var = param;
+        }
+    }
+    if (!has_clause) {
+        return eval(args->get_value(), env);
+    }
 
-        return std::make_shared<Function>(std::list<std::shared_ptr<Symbol>>(),
-                                          lambda_body);
-    } else {
-        throw EvalException("first argument of lambda must be list");
+    std::string message;
+    try {
+        return eval(args->get_value(), env);
+    } catch (LimitExceeded &e) {
+        if (limits_exhausted()) {
+            throw;
+        }
+        if (var != nullptr) {
+            message = e.what();
+        }
+    } catch (EvalException &e) {
+        if (var != nullptr) {
+            message = e.what();
+        }
+    } catch (EnvException &e) {
+        if (var != nullptr) {
+            message = e.what();
+        }
+    }
+    Env handler_env(env);
+    if (var != nullptr) {
+        handler_env.set_obj(var->get_symbol(), make_object<String>(message));
     }
+    std::shared_ptr<Object> result = GLOBAL_NIL;
+    for (auto head = handler; head != nullptr; head = head->get_next()) {
+        result = eval(head->get_value(), handler_env);
+        RETURN_IF_THROWING();
+    }
+    return result;
 }
 
-std::shared_ptr<Object> fn_macro(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    TAKE_ONE_ARG("macro", args, a1);
+std::istream &prompt(std::istream &is, const std::string &msg,
+                     std::string &input) {
+    std::cout << msg << " " << std::flush;
+    return std::getline(is, input);
+}
 
-    if (a1->kind() == ObjectKind::List) {
-        std::list<std::shared_ptr<Symbol>> macro_args = {};
-        auto head = std::static_pointer_cast<List>(a1);
-        while (head != nullptr) {
-            auto obj = head->get_value();
-            if (obj->kind() != ObjectKind::Symbol) {
-                throw EvalException("list elements of macro must be symbol");
-            } else {
-                macro_args.push_back(std::static_pointer_cast<Symbol>(obj));
-                head = head->get_next();
-            }
-        }
+// Latency of top level forms.
+//
+// Every top level form is timed into a histogram, which is printed at exit
+// and on SIGUSR1 with --slow-forms. Forms slower than the threshold are
+// logged as they finish.
 
-        std::list<std::shared_ptr<Object>> macro_body = {};
-        if (args->get_next() != nullptr) {
-            macro_body = args->get_next()->to_list();
-        }
+// Log-linear histogram in the manner of HdrHistogram. Values are bucketed by
+// their power of two, each of which is split into 2^SUB_BUCKET_BITS linear
+// sub-buckets, so a value is known to within 1/16 of itself.
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = SUB_BUCKETS * (65 - SUB_BUCKET_BITS);
 
-        return std::make_shared<Macro>(macro_args, macro_body);
-    } else if (a1->kind() == ObjectKind::NIL) {
-        std::list<std::shared_ptr<Object>> macro_body = {};
-        if (args->get_next() != nullptr) {
-            macro_body = args->get_next()->to_list();
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> max;
+
+    static int bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
         }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BUCKET_BITS;
+        return SUB_BUCKETS * (shift + 1) + ((value >> shift) - SUB_BUCKETS);
+    }
 
-        return std::make_shared<Macro>(std::list<std::shared_ptr<Symbol>>(),
-                                       macro_body);
-    } else {
-        throw EvalException("first argument of macro must be list");
+    // The smallest value in the bucket.
+    static uint64_t lower_bound(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS)
+               << shift;
     }
-}
 
-std::shared_ptr<Object> fn_set(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1, a2;
-    EVAL_JUST_TWO_ARG("set", args, env, a1, a2);
+public:
+    LatencyHistogram() : counts{}, max(0) {}
 
-    if (a1->kind() != ObjectKind::Symbol) {
-        throw EvalException("first argument of set must have symbol");
+    void record(uint64_t value) {
+        counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t previous = max.load(std::memory_order_relaxed);
+        while (value > previous &&
+               !max.compare_exchange_weak(previous, value)) {
+        }
     }
-    auto name = std::static_pointer_cast<Symbol>(a1)->get_symbol();
-    env.set_obj(name, a2);
-    return a2;
-}
 
-std::shared_ptr<Object> fn_int_to_string(const std::shared_ptr<List> args,
-                                         Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("int-to-string", args, env, a1);
+    // Prints the count, percentiles and non-empty buckets, of values in
+    // nanoseconds, in milliseconds.
+    void print(std::ostream &os) const {
+        uint64_t snapshot[BUCKETS];
+        uint64_t total = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            snapshot[i] = counts[i].load(std::memory_order_relaxed);
+            total += snapshot[i];
+        }
+        char line[256];
+        std::snprintf(line, sizeof(line), "forms: %lu\n", total);
+        os << line;
+        if (total == 0) {
+            return;
+        }
 
-    if (a1->kind() == ObjectKind::Integer) {
-        auto integer = std::static_pointer_cast<Integer>(a1)->get_integer();
-        return std::make_shared<String>(std::to_string(integer));
-    } else {
-        throw EvalException("given object is not an integer");
+        // Nearest rank percentiles, in tenths of a percent so that the rank
+        // is rounded up exactly.
+        for (uint64_t permille : {500, 900, 990, 999}) {
+            uint64_t rank =
+                std::max<uint64_t>(1, (total * permille + 999) / 1000);
+            uint64_t seen = 0;
+            int i = 0;
+            while ((seen += snapshot[i]) < rank) {
+                i++;
+            }
+            std::snprintf(line, sizeof(line), "p%g: %.3f ms\n",
+                          permille / 10.0, lower_bound(i) / 1e6);
+            os << line;
+        }
+        std::snprintf(line, sizeof(line), "max: %.3f ms\n", max.load() / 1e6);
+        os << line;
+
+        for (int i = 0; i < BUCKETS; i++) {
+            if (snapshot[i] != 0) {
+                std::snprintf(line, sizeof(line), "  >= %12.3f ms: %lu\n",
+                              lower_bound(i) / 1e6, snapshot[i]);
+                os << line;
+            }
+        }
+        os << std::flush;
     }
-}
+};
 
-std::shared_ptr<Object> fn_num_to_string(const std::shared_ptr<List> args,
-                                         Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("num-to-string", args, env, a1);
+static LatencyHistogram FORM_LATENCY;
+// Forms slower than this are logged. Negative disables the log.
+static long SLOW_FORM_THRESHOLD_NS = -1;
+static volatile sig_atomic_t FORM_LATENCY_DUMP_REQUESTED = 0;
+
+void request_form_latency_dump(int) { FORM_LATENCY_DUMP_REQUESTED = 1; }
 
-    if (a1->kind() == ObjectKind::Number) {
-        auto number = std::static_pointer_cast<Number>(a1)->get_number();
-        return std::make_shared<String>(std::to_string(number));
-    } else {
-        throw EvalException("given object is not a number");
+// Prints the histogram on SIGUSR1, once the current form has finished.
+void install_form_latency_dump_handler() {
+    struct sigaction sa = {};
+    sa.sa_handler = request_form_latency_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+}
+
+// Returns `s` cut to `width` characters, marking the cut.
+std::string truncate(const std::string &s, size_t width) {
+    if (s.size() <= width) {
+        return s;
     }
+    return s.substr(0, width - 3) + "...";
 }
 
-std::shared_ptr<Object> fn_debug(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("debug", args, env, a1);
-    return std::make_shared<String>(a1->debug());
+// Lexes and parses the source of top level forms from `file`, tracing both.
+std::vector<std::shared_ptr<Object>> read_forms(const std::string &input,
+                                                const std::string &file) {
+    std::vector<std::shared_ptr<Token>> tokens;
+    {
+        TraceSpan span("lex", file.c_str());
+        tokens = lex(input);
+    }
+    TraceSpan span("parse", file.c_str());
+    PARSE_FILE = source_file_id(file);
+    return parse(tokens);
 }
 
-std::shared_ptr<Object> fn_type_of(const std::shared_ptr<List> args, Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_JUST_ONE_ARG("type-of", args, env, a1);
+// Returns where `obj`, the `index`th form of its source, starts.
+std::string toplevel_location(const std::shared_ptr<Object> &obj,
+                              size_t index) {
+    std::string location = source_location(obj);
+    return location.empty() ? "#" + std::to_string(index + 1) : location;
+}
 
-    switch (a1->kind()) {
-        case ObjectKind::List:
-            return std::make_shared<String>("List");
-        case ObjectKind::T:
-            return std::make_shared<String>("T");
-        case ObjectKind::NIL:
-            return std::make_shared<String>("NIL");
-        case ObjectKind::Integer:
-            return std::make_shared<String>("Integer");
-        case ObjectKind::Number:
-            return std::make_shared<String>("Number");
-        case ObjectKind::String:
-            return std::make_shared<String>("String");
-        case ObjectKind::Symbol:
-            return std::make_shared<String>("Symbol");
-        case ObjectKind::Function:
-            return std::make_shared<String>("Function");
-        case ObjectKind::FuncPtr:
-            return std::make_shared<String>("FuncPtr");
-        case ObjectKind::PartiallyAppliedFunction:
-            return std::make_shared<String>("PartiallyAppliedFunction");
-        case ObjectKind::PartiallyAppliedFuncPtr:
-            return std::make_shared<String>("PartiallyAppliedFuncPtr");
-        case ObjectKind::Macro:
-            return std::make_shared<String>("Macro");
-        case ObjectKind::Quoted:
-            return std::make_shared<String>("Quoted");
-        case ObjectKind::BackQuoted:
-            return std::make_shared<String>("BackQuoted");
-        case ObjectKind::Comma:
-            return std::make_shared<String>("Comma");
-        case ObjectKind::CommaAtmark:
-            return std::make_shared<String>("CommaAtmark");
-        default:
-            throw EvalException("unreachable");
+// Adds the time of a top level form which started at `start` to the
+// histogram, and logs it if it was slow.
+void record_form_time(const std::shared_ptr<Object> &obj, size_t index,
+                      std::chrono::steady_clock::time_point start,
+                      bool failed) {
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    FORM_LATENCY.record(elapsed);
+    if (SLOW_FORM_THRESHOLD_NS >= 0 &&
+        elapsed >= static_cast<uint64_t>(SLOW_FORM_THRESHOLD_NS)) {
+        char line[64];
+        std::snprintf(line, sizeof(line), "slow form (%.3f ms%s) ",
+                      elapsed / 1e6, failed ? ", failed" : "");
+        *LISP_ERR << line << toplevel_location(obj, index) << ": "
+                  << truncate(obj->debug(), 72) << std::endl;
     }
 }
 
-std::shared_ptr<Object> fn_concat(const std::shared_ptr<List> args, Env &env) {
-    std::string acc;
-    std::shared_ptr<Object> a1, a2;
-    EVAL_TWO_ARG("concat", args, env, a1, a2);
-    if (a1->kind() == ObjectKind::String && a2->kind() == ObjectKind::String) {
-        acc = std::static_pointer_cast<String>(a1)->get_string() +
-              std::static_pointer_cast<String>(a2)->get_string();
-    } else {
-        throw EvalException("arguments of concat must be string");
+// Evaluates the `index`th form of its source, timing it.
+std::shared_ptr<Object> eval_toplevel(const std::shared_ptr<Object> &obj,
+                                      Env &env, size_t index) {
+    TraceSpan span("eval");
+    if (span.is_active()) {
+        span.set_detail(toplevel_location(obj, index) + " " + obj->debug());
     }
-    auto head = args->get_next()->get_next();
-    while (head != nullptr) {
-        std::shared_ptr<Object> a;
-        EVAL_ONE_ARG("concat", head, env, a);
-        if (a->kind() == ObjectKind::String) {
-            acc += std::static_pointer_cast<String>(a)->get_string();
-        } else {
-            throw EvalException("arguments of concat must be string");
-        }
-        head = head->get_next();
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<Object> result;
+    try {
+        result = MAX_STEPS >= 0 || TIMEOUT_MS >= 0
+                     ? eval_with_limits(env, MAX_STEPS, TIMEOUT_MS,
+                                        [&] { return eval(obj, env); })
+                     : eval(obj, env);
+    } catch (...) {
+        // Forms which fail are often the ones worth seeing.
+        record_form_time(obj, index, start, true);
+        throw;
     }
-    return std::make_shared<String>(acc);
-}
-
-std::shared_ptr<Object> fn_macroexpand(const std::shared_ptr<List> args,
-                                       Env &env) {
-    std::shared_ptr<Object> a1;
-    EVAL_ONE_ARG("macroexpand", args, env, a1);
+    record_form_time(obj, index, start, false);
 
-    if (a1->kind() != ObjectKind::List) {
-        throw EvalException(
-            "first argument of macroexpand must be evaluated to list");
+    if (FORM_LATENCY_DUMP_REQUESTED) {
+        FORM_LATENCY_DUMP_REQUESTED = 0;
+        FORM_LATENCY.print(std::cerr);
     }
-
-    auto list = std::static_pointer_cast<List>(a1);
-    if (list->get_value()->kind() == ObjectKind::Symbol) {
-        auto macro_name =
-            std::static_pointer_cast<Symbol>(list->get_value())->get_symbol();
-        auto maybe_macro = env.get_obj(macro_name);
-        if (maybe_macro->kind() != ObjectKind::Macro) {
-            throw EvalException("first element of list must hold macro");
-        }
-        auto macro = std::static_pointer_cast<Macro>(maybe_macro);
-        auto expanded = expand_macro(macro, list->get_next(), env);
-        if (expanded.empty()) {
-            return GLOBAL_NIL;
-        } else {
-            return *expanded.rbegin();
-        }
-    } else if (list->get_value()->kind() == ObjectKind::Macro) {
-        auto macro = std::static_pointer_cast<Macro>(list->get_value());
-        auto expanded = expand_macro(macro, list->get_next(), env);
-        if (expanded.empty()) {
-            return GLOBAL_NIL;
-        } else {
-            return *expanded.rbegin();
+    static thread_local long forms_since_cycle_check = 0;
+    if (CYCLE_CHECK_INTERVAL > 0 &&
+        ++forms_since_cycle_check >= CYCLE_CHECK_INTERVAL) {
+        forms_since_cycle_check = 0;
+        collect_cycles(*LISP_ERR, BREAK_CYCLES);
+    }
+    if (HEAP_DUMP_REQUESTED) {
+        HEAP_DUMP_REQUESTED = 0;
+        if (!dump_heap(HEAP_DUMP_PATH, env)) {
+            std::cerr << "faild to write heap snapshot to " << HEAP_DUMP_PATH
+                      << std::endl;
         }
-    } else {
-        throw EvalException("first element of list must be symbol or macro");
     }
-}
-
-std::istream &prompt(std::istream &is, const std::string &msg,
-                     std::string &input) {
-    std::cout << msg << " " << std::flush;
-    return std::getline(is, input);
+    return result;
 }
 
 void interpreter(Env &env) {
+    std::unique_ptr<HeapBudget> budget;
+    if (MAX_HEAP_BYTES > 0) {
+        budget.reset(new HeapBudget(MAX_HEAP_BYTES));
+    }
     std::string input;
     std::cout << "press CTRL-D to exit from this interpreter" << std::endl;
     int line = 1;
     while (prompt(std::cin, "[" + std::to_string(line) + "]>", input)) {
         try {
-            auto tokens = lex(input);
-            auto objs = parse(tokens);
-            for (const auto &obj : objs) {
-                std::cout << eval(obj, env)->debug() << std::endl;
+            auto objs = read_forms(input, "<stdin>");
+            for (size_t i = 0; i < objs.size(); i++) {
+                std::cout << eval_toplevel(objs[i], env, i)->debug()
+                          << std::endl;
+                env.compact();
             }
             line++;
         } catch (std::exception &e) {
@@ -2132,87 +5691,790 @@ void interpreter(Env &env) {
     }
 }
 
-void run(std::string input, Env &env) {
+bool run(std::string input, Env &env, const std::string &file = "<string>") {
+    std::unique_ptr<HeapBudget> budget;
+    if (MAX_HEAP_BYTES > 0) {
+        budget.reset(new HeapBudget(MAX_HEAP_BYTES));
+    }
     try {
-        for (const auto &obj : parse(lex(input))) {
-            eval(obj, env);
+        auto objs = read_forms(input, file);
+        for (size_t i = 0; i < objs.size(); i++) {
+            eval_toplevel(objs[i], env, i);
+            env.compact();
         }
+        return true;
     } catch (std::exception &e) {
-        std::cerr << e.what() << std::endl;
+        *LISP_ERR << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Evaluates forms defining the default environment. They aren't the user's,
+// so they are left out of the form times and the limits.
+void run_prelude(const std::string &input, Env &env) {
+    for (const auto &obj : read_forms(input, "<prelude>")) {
+        eval(obj, env);
+    }
+}
+
+bool read_file(const std::string &filename, std::string &content) {
+    std::ifstream ifs(filename);
+    if (!ifs) {
+        return false;
+    }
+    content.assign(std::istreambuf_iterator<char>(ifs),
+                   std::istreambuf_iterator<char>());
+    return true;
+}
+
+struct BatchResult {
+    std::string out;
+    std::string err;
+    int status;
+};
+
+// Runs a script in its own copy of `template_env`, capturing its output.
+BatchResult run_batch_script(const std::string &filename,
+                             const Env &template_env) {
+    std::ostringstream out, err;
+    std::string content;
+    int status = 1;
+    if (!read_file(filename, content)) {
+        err << "faild to open file " << filename << std::endl;
+    } else {
+        Env env = template_env;
+        LISP_OUT = &out;
+        LISP_ERR = &err;
+        status = run(content, env, filename) ? 0 : 1;
+        LISP_OUT = &std::cout;
+        LISP_ERR = &std::cerr;
+    }
+    return BatchResult{out.str(), err.str(), status};
+}
+
+// Runs the scripts on a pool of worker threads and reports their output and
+// exit status in the given order. Returns 1 if any of them failed.
+int run_batch(const std::vector<std::string> &files, const Env &template_env) {
+    ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::future<BatchResult>> results;
+    for (const auto &file : files) {
+        results.push_back(pool.submit([&file, &template_env] {
+            return run_batch_script(file, template_env);
+        }));
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        auto result = results[i].get();
+        TraceSpan span("flush", files[i].c_str());
+        // Every script gets a header, so that its output, which is written
+        // after it, can't be taken for another's. Output is ended with a
+        // newline, so that the next header starts a line.
+        for (auto *text : {&result.out, &result.err}) {
+            if (!text->empty() && text->back() != '\n') {
+                text->push_back('\n');
+            }
+        }
+        std::cout << "==> " << files[i] << ": exit status " << result.status
+                  << " <==\n"
+                  << result.out << std::flush;
+        std::cerr << result.err << std::flush;
+        if (result.status != 0) {
+            failed++;
+        }
+    }
+    if (failed != 0) {
+        std::cerr << failed << " of " << files.size() << " scripts failed"
+                  << std::endl;
     }
+    return failed == 0 ? 0 : 1;
+}
+
+void set_buildin(
+    Env &env, const std::string &name,
+    std::function<std::shared_ptr<Object>(const std::shared_ptr<List>, Env &)>
+        func,
+    Purity purity = Purity::Impure) {
+    auto buildin = make_object<FuncPtr>(func, purity);
+    buildin->set_name(intern_name(name));
+    env.set_obj(name, buildin);
 }
 
 Env default_env() {
     Env env;
-    env.set_obj("quote", std::make_shared<FuncPtr>(fn_quote));
-    env.set_obj("list", std::make_shared<FuncPtr>(fn_list));
-    env.set_obj("car", std::make_shared<FuncPtr>(fn_car));
-    env.set_obj("cdr", std::make_shared<FuncPtr>(fn_cdr));
-    env.set_obj("cons", std::make_shared<FuncPtr>(fn_cons));
-    env.set_obj("atom", std::make_shared<FuncPtr>(fn_atom));
-    env.set_obj("if", std::make_shared<FuncPtr>(fn_if));
-    env.set_obj("=", std::make_shared<FuncPtr>(fn_eq_num));
-    env.set_obj("/=", std::make_shared<FuncPtr>(fn_ne_num));
-    env.set_obj("<", std::make_shared<FuncPtr>(fn_lt_num));
-    env.set_obj(">", std::make_shared<FuncPtr>(fn_gt_num));
-    env.set_obj("<=", std::make_shared<FuncPtr>(fn_le_num));
-    env.set_obj(">=", std::make_shared<FuncPtr>(fn_ge_num));
-    env.set_obj("+", std::make_shared<FuncPtr>(fn_add_num));
-    env.set_obj("-", std::make_shared<FuncPtr>(fn_sub_num));
-    env.set_obj("*", std::make_shared<FuncPtr>(fn_mul_num));
-    env.set_obj("/", std::make_shared<FuncPtr>(fn_div_num));
-    env.set_obj("string-nth", std::make_shared<FuncPtr>(fn_string_nth));
-    env.set_obj("string=", std::make_shared<FuncPtr>(fn_eq_str));
-    env.set_obj("string/=", std::make_shared<FuncPtr>(fn_ne_str));
-    env.set_obj("string<", std::make_shared<FuncPtr>(fn_lt_str));
-    env.set_obj("string>", std::make_shared<FuncPtr>(fn_gt_str));
-    env.set_obj("string<=", std::make_shared<FuncPtr>(fn_le_str));
-    env.set_obj("string>=", std::make_shared<FuncPtr>(fn_ge_str));
-    env.set_obj("string-equal", std::make_shared<FuncPtr>(fn_equal_str));
-    env.set_obj("write", std::make_shared<FuncPtr>(fn_write));
-    env.set_obj("write-line", std::make_shared<FuncPtr>(fn_write_line));
-    env.set_obj("print", std::make_shared<FuncPtr>(fn_print));
-    env.set_obj("prin1", std::make_shared<FuncPtr>(fn_prin1));
-    env.set_obj("princ", std::make_shared<FuncPtr>(fn_princ));
-    env.set_obj("read-str", std::make_shared<FuncPtr>(fn_read_str));
-    env.set_obj("read-int", std::make_shared<FuncPtr>(fn_read_int));
-    env.set_obj("read-num", std::make_shared<FuncPtr>(fn_read_num));
-    env.set_obj("lambda", std::make_shared<FuncPtr>(fn_lambda));
-    env.set_obj("macro", std::make_shared<FuncPtr>(fn_macro));
-    env.set_obj("set", std::make_shared<FuncPtr>(fn_set));
-    env.set_obj("int-to-string", std::make_shared<FuncPtr>(fn_int_to_string));
-    env.set_obj("num-to-string", std::make_shared<FuncPtr>(fn_num_to_string));
-    env.set_obj("debug", std::make_shared<FuncPtr>(fn_debug));
-    env.set_obj("type-of", std::make_shared<FuncPtr>(fn_type_of));
-    env.set_obj("concat", std::make_shared<FuncPtr>(fn_concat));
-    env.set_obj("macroexpand", std::make_shared<FuncPtr>(fn_macroexpand));
+    set_buildin(env, "quote", fn_quote, Purity::Pure);
+    set_buildin(env, "list", fn_list, Purity::Strict);
+    set_buildin(env, "car", fn_car, Purity::Strict);
+    set_buildin(env, "cdr", fn_cdr, Purity::Strict);
+    set_buildin(env, "cons", fn_cons, Purity::Strict);
+    set_buildin(env, "rplaca", fn_rplaca);
+    set_buildin(env, "rplacd", fn_rplacd);
+    set_buildin(env, "atom", fn_atom, Purity::Strict);
+    set_buildin(env, "if", fn_if, Purity::Pure);
+    set_buildin(env, "=", fn_eq_num, Purity::Strict);
+    set_buildin(env, "/=", fn_ne_num, Purity::Strict);
+    set_buildin(env, "<", fn_lt_num, Purity::Strict);
+    set_buildin(env, ">", fn_gt_num, Purity::Strict);
+    set_buildin(env, "<=", fn_le_num, Purity::Strict);
+    set_buildin(env, ">=", fn_ge_num, Purity::Strict);
+    set_buildin(env, "+", fn_add_num, Purity::Strict);
+    set_buildin(env, "-", fn_sub_num, Purity::Strict);
+    set_buildin(env, "*", fn_mul_num, Purity::Strict);
+    set_buildin(env, "/", fn_div_num, Purity::Strict);
+    set_buildin(env, "string-nth", fn_string_nth, Purity::Strict);
+    set_buildin(env, "string=", fn_eq_str, Purity::Strict);
+    set_buildin(env, "string/=", fn_ne_str, Purity::Strict);
+    set_buildin(env, "string<", fn_lt_str, Purity::Strict);
+    set_buildin(env, "string>", fn_gt_str, Purity::Strict);
+    set_buildin(env, "string<=", fn_le_str, Purity::Strict);
+    set_buildin(env, "string>=", fn_ge_str, Purity::Strict);
+    set_buildin(env, "string-equal", fn_equal_str, Purity::Strict);
+    set_buildin(env, "write", fn_write);
+    set_buildin(env, "write-line", fn_write_line);
+    set_buildin(env, "print", fn_print);
+    set_buildin(env, "prin1", fn_prin1);
+    set_buildin(env, "princ", fn_princ);
+    set_buildin(env, "read-str", fn_read_str);
+    set_buildin(env, "read-int", fn_read_int);
+    set_buildin(env, "read-num", fn_read_num);
+    set_buildin(env, "lambda", fn_lambda, Purity::Pure);
+    set_buildin(env, "macro", fn_macro, Purity::Pure);
+    set_buildin(env, "set", fn_set);
+    set_buildin(env, "int-to-string", fn_int_to_string, Purity::Strict);
+    set_buildin(env, "num-to-string", fn_num_to_string, Purity::Strict);
+    set_buildin(env, "debug", fn_debug, Purity::Strict);
+    set_buildin(env, "type-of", fn_type_of, Purity::Strict);
+    set_buildin(env, "concat", fn_concat, Purity::Strict);
+    set_buildin(env, "macroexpand", fn_macroexpand);
+    set_buildin(env, "auto-parallel-count", fn_auto_parallel_count);
+    set_buildin(env, "with-profiling", fn_with_profiling);
+    set_buildin(env, "alloc-stats", fn_alloc_stats);
+    set_buildin(env, "time", fn_time);
+    set_buildin(env, "room", fn_room);
+    set_buildin(env, "dump-heap", fn_dump_heap);
+    set_buildin(env, "collect-cycles", fn_collect_cycles);
+    set_buildin(env, "with-counters", fn_with_counters);
+    set_buildin(env, "get-internal-real-time", fn_get_internal_real_time);
+    set_buildin(env, "with-memory-limit", fn_with_memory_limit);
+    set_buildin(env, "with-limits", fn_with_limits);
+    set_buildin(env, "catch", fn_catch);
+    set_buildin(env, "throw", fn_throw);
+    set_buildin(env, "handler-case", fn_handler_case);
     env.set_obj("T", GLOBAL_T);
     env.set_obj("NIL", GLOBAL_NIL);
 
-    run("(set 'setq (macro (name value) `(set ',name ,value)))", env);
-    run("(setq defmacro (macro (name args &body body) `(setq ,name (macro "
+    run_prelude("(set 'setq (macro (name value) `(set ',name ,value)))", env);
+    run_prelude(
+        "(setq defmacro (macro (name args &body body) `(setq ,name (macro "
         ",args "
         ",@body))))",
         env);
-    run("(defmacro defun (name args &body body) `(setq ,name (lambda ,args "
+    run_prelude(
+        "(defmacro defun (name args &body body) `(setq ,name (lambda ,args "
         ",@body)))",
         env);
 
+    env.compact();
     return env;
 }
 
+// Server mode.
+//
+// Requests and responses are framed over a unix domain socket. A request is
+// a 4 byte big endian length followed by source text. A response is a status
+// byte (0 on success, 1 on error), a 4 byte big endian length and either the
+// output of the request followed by the printed value of its last form, or
+// the error message.
+
+const size_t MAX_REQUEST_SIZE = 16 * 1024 * 1024;
+
+static volatile sig_atomic_t SERVER_STOPPING = 0;
+
+void stop_server(int) { SERVER_STOPPING = 1; }
+
+struct Connection {
+    int fd;
+    bool eof;
+    std::string in;
+    std::string out;
+    std::unique_ptr<Env> env;
+};
+
+std::string eval_request(const std::string &source, Env &env, bool &ok) {
+    // What the request writes to either stream goes to its client, in order.
+    std::ostringstream out;
+    LISP_OUT = &out;
+    LISP_ERR = &out;
+    std::unique_ptr<HeapBudget> budget;
+    if (MAX_HEAP_BYTES > 0) {
+        budget.reset(new HeapBudget(MAX_HEAP_BYTES));
+    }
+    // Limits the request as a whole, as well as each of its forms.
+    EvalLimits limits(MAX_STEPS, TIMEOUT_MS);
+    try {
+        std::shared_ptr<Object> result = GLOBAL_NIL;
+        auto objs = read_forms(source, "<request>");
+        for (size_t i = 0; i < objs.size(); i++) {
+            result = eval_toplevel(objs[i], env, i);
+        }
+        out << result->debug();
+        ok = true;
+    } catch (std::exception &e) {
+        out.str(e.what());
+        ok = false;
+    }
+    LISP_OUT = &std::cout;
+    LISP_ERR = &std::cerr;
+    return out.str();
+}
+
+void append_frame(std::string &buf, uint8_t status, const std::string &body) {
+    uint32_t len = htonl(static_cast<uint32_t>(body.size()));
+    buf.push_back(static_cast<char>(status));
+    buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
+    buf.append(body);
+}
+
+// Evaluates every complete request in `conn.in`. Returns how many there were,
+// or -1 if the peer sent a malformed frame. With `isolate_requests` the
+// changes a request makes to the environment are undone after it.
+int handle_requests(Connection &conn, Env &global_env, bool isolate_requests) {
+    int count = 0;
+    size_t pos = 0;
+    while (conn.in.size() - pos >= sizeof(uint32_t)) {
+        uint32_t len;
+        std::memcpy(&len, conn.in.data() + pos, sizeof(len));
+        len = ntohl(len);
+        if (len > MAX_REQUEST_SIZE) {
+            return -1;
+        } else if (conn.in.size() - pos - sizeof(len) < len) {
+            break;
+        }
+
+        std::string source = conn.in.substr(pos + sizeof(len), len);
+        pos += sizeof(len) + len;
+        bool ok;
+        Env &env = conn.env != nullptr ? *conn.env : global_env;
+        std::string body;
+        if (isolate_requests) {
+            auto mark = env.snapshot();
+            body = eval_request(source, env, ok);
+            env.rollback(mark);
+        } else {
+            body = eval_request(source, env, ok);
+            env.compact();
+        }
+        append_frame(conn.out, ok ? 0 : 1, body);
+        count++;
+    }
+    conn.in.erase(0, pos);
+    return count;
+}
+
+// Returns false if the connection was closed by an error.
+bool flush_output(Connection &conn) {
+    TraceSpan span("flush");
+    while (!conn.out.empty()) {
+        auto n = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn.out.erase(0, n);
+    }
+    return true;
+}
+
+struct ServeOptions {
+    // Give each connection its own copy of the environment.
+    bool isolate = false;
+    // Undo the changes each request makes to the environment.
+    bool isolate_requests = false;
+    // Number of pre-forked worker processes, or 0 to serve in this process.
+    int workers = 0;
+    // A worker is recycled after this many requests, or once its resident
+    // set grew by this many bytes. 0 means no limit.
+    long max_requests = 0;
+    long max_rss_growth = 0;
+};
+
+void install_stop_handler() {
+    // No SA_RESTART, so that blocking calls return on these signals.
+    struct sigaction sa = {};
+    sa.sa_handler = stop_server;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+// Requests between checks of the resident set against `max_rss_growth`, as
+// each check reads /proc.
+const long RSS_CHECK_REQUESTS = 16;
+
+long resident_set_size() {
+    long pages = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int listen_unix(const std::string &path) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        std::cerr << "faild to create socket: " << strerror(errno)
+                  << std::endl;
+        return -1;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path is too long: " << path << std::endl;
+        close(listen_fd);
+        return -1;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    auto sa = reinterpret_cast<sockaddr *>(&addr);
+    if (bind(listen_fd, sa, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        std::cerr << "faild to listen on " << path << ": " << strerror(errno)
+                  << std::endl;
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+// Serves connections accepted on `listen_fd` until SIGINT or SIGTERM, or until
+// the recycling limits of `opts` are reached. Once they are, no more
+// connections are accepted and the open ones are closed as soon as they are
+// idle, so clients are expected to reconnect.
+void serve_loop(int listen_fd, Env &env, const ServeOptions &opts) {
+    int epoll_fd = epoll_create1(0);
+    epoll_event ev = {};
+    // Wake a single worker per connection when they share the socket.
+    ev.events = opts.workers > 0 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    std::map<int, Connection> conns;
+    auto close_conn = [&](int fd) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns.erase(fd);
+    };
+
+    const long base_rss = resident_set_size();
+    long handled = 0;
+    long next_rss_check = RSS_CHECK_REQUESTS;
+    bool draining = false;
+    std::vector<epoll_event> events(64);
+    char buf[64 * 1024];
+    while (!SERVER_STOPPING && !(draining && conns.empty())) {
+        int n = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int client;
+                while (!draining &&
+                       (client = accept4(listen_fd, nullptr, nullptr,
+                                         SOCK_NONBLOCK)) >= 0) {
+                    epoll_event cev = {};
+                    cev.events = EPOLLIN;
+                    cev.data.fd = client;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &cev);
+                    auto &conn = conns[client];
+                    conn.fd = client;
+                    conn.eof = false;
+                    if (opts.isolate) {
+                        conn.env = std::make_unique<Env>(env);
+                    }
+                }
+                continue;
+            } else if (conns.count(fd) == 0) {
+                continue;
+            }
+
+            auto &conn = conns[fd];
+            bool broken = (events[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+            if (!broken && (events[i].events & EPOLLIN)) {
+                ssize_t r;
+                while ((r = read(fd, buf, sizeof(buf))) > 0) {
+                    conn.in.append(buf, r);
+                }
+                if (r == 0) {
+                    conn.eof = true;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    broken = true;
+                }
+                int count =
+                    handle_requests(conn, env, opts.isolate_requests);
+                if (count < 0) {
+                    broken = true;
+                } else {
+                    handled += count;
+                }
+            }
+            if (!broken && !flush_output(conn)) {
+                broken = true;
+            }
+
+            bool idle = conn.in.empty() && conn.out.empty();
+            if (broken || (conn.eof && conn.out.empty()) ||
+                (draining && idle)) {
+                close_conn(fd);
+            } else {
+                // After EOF only the remaining responses are waited for.
+                epoll_event cev = {};
+                cev.events = conn.eof ? 0u : static_cast<uint32_t>(EPOLLIN);
+                if (!conn.out.empty()) {
+                    cev.events |= EPOLLOUT;
+                }
+                cev.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &cev);
+            }
+        }
+
+        bool grown = false;
+        if (opts.max_rss_growth > 0 && handled >= next_rss_check) {
+            next_rss_check = handled + RSS_CHECK_REQUESTS;
+            grown = resident_set_size() - base_rss > opts.max_rss_growth;
+        }
+        if (!draining &&
+            ((opts.max_requests > 0 && handled >= opts.max_requests) ||
+             grown)) {
+            draining = true;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+            std::vector<int> idle_fds;
+            for (const auto &conn : conns) {
+                if (conn.second.in.empty() && conn.second.out.empty()) {
+                    idle_fds.push_back(conn.first);
+                }
+            }
+            for (int fd : idle_fds) {
+                close_conn(fd);
+            }
+        }
+    }
+
+    for (auto &conn : conns) {
+        close(conn.first);
+    }
+    close(epoll_fd);
+}
+
+// A worker which exits sooner than this after it was forked is replaced only
+// after a delay, which doubles for each such worker in a row up to the
+// maximum, so that a crashing worker isn't respawned in a busy loop.
+const long RESPAWN_MIN_LIFETIME_MS = 1000;
+const long RESPAWN_FIRST_DELAY_MS = 100;
+const long RESPAWN_MAX_DELAY_MS = 5000;
+
+// Forks `opts.workers` processes serving `listen_fd`, replacing each one that
+// exits, until SIGINT or SIGTERM. The workers share the warm heap of this
+// process copy-on-write.
+void serve_prefork(int listen_fd, Env &env, const ServeOptions &opts) {
+    // Give free pages back to the kernel, so that they don't count towards
+    // the resident set of every worker. Free chunks in partly used pages are
+    // still reused by the workers, and reference counts dirty the pages of
+    // the objects they share, so those pages get copied all the same.
+    malloc_trim(0);
+
+    std::map<pid_t, std::chrono::steady_clock::time_point> workers;
+    auto spawn = [&] {
+        flush_trace_before_fork();
+        pid_t pid = fork();
+        if (pid == 0) {
+            trace_forked_child();
+            serve_loop(listen_fd, env, opts);
+            stop_trace();
+            std::cout.flush();
+            _exit(0);
+        } else if (pid > 0) {
+            workers[pid] = std::chrono::steady_clock::now();
+        } else {
+            std::cerr << "faild to fork: " << strerror(errno) << std::endl;
+        }
+    };
+
+    for (int i = 0; i < opts.workers; i++) {
+        spawn();
+    }
+    long delay_ms = 0;
+    while (!SERVER_STOPPING && !workers.empty()) {
+        pid_t pid = waitpid(-1, nullptr, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        auto it = workers.find(pid);
+        if (it == workers.end()) {
+            continue;
+        }
+        auto lifetime = std::chrono::steady_clock::now() - it->second;
+        workers.erase(it);
+        if (lifetime < std::chrono::milliseconds(RESPAWN_MIN_LIFETIME_MS)) {
+            delay_ms = std::min(
+                std::max(delay_ms * 2, RESPAWN_FIRST_DELAY_MS),
+                RESPAWN_MAX_DELAY_MS);
+            // Interrupted by the stop signals, which end the loop.
+            timespec delay = {delay_ms / 1000, delay_ms % 1000 * 1000000};
+            nanosleep(&delay, nullptr);
+        } else {
+            delay_ms = 0;
+        }
+        if (!SERVER_STOPPING) {
+            spawn();
+        }
+    }
+
+    for (const auto &worker : workers) {
+        kill(worker.first, SIGTERM);
+    }
+    while (waitpid(-1, nullptr, 0) > 0) {
+    }
+}
+
+// Accepts requests on `path` until SIGINT or SIGTERM, evaluating them in
+// `env`.
+int serve(const std::string &path, Env &env, const ServeOptions &opts) {
+    int listen_fd = listen_unix(path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    install_stop_handler();
+    if (opts.workers > 0) {
+        serve_prefork(listen_fd, env, opts);
+    } else {
+        serve_loop(listen_fd, env, opts);
+    }
+
+    close(listen_fd);
+    unlink(path.c_str());
+    return 0;
+}
+
+void usage(const char *program) {
+    std::cerr << "usage: " << program << " [OPTION...] [FILENAME]\n"
+              << "       " << program << " [OPTION...] --batch [FILENAME...]\n"
+              << "       " << program << " [OPTION...] --serve SOCKET\n"
+              << R"(
+options:
+  --auto-parallel      evaluate arguments of pure calls in parallel
+  --profile FILE       write a sampling profile in folded stack format
+  --call-profile       print calls and time spent per function at exit
+  --alloc-profile N    attribute 1 in N allocations to functions and print
+                       allocation stats at exit
+  --perf-counters      print hardware performance counters at exit
+  --stats              print heap and evaluation stats at exit
+  --slow-forms MS      log top level forms taking at least MS milliseconds,
+                       and print a histogram of form times at exit and on
+                       SIGUSR1
+  --trace FILE         write a timeline of lexing, parsing, evaluation and
+                       macro expansion in Chrome trace event format
+  --trace-calls US     also trace function calls taking at least US
+                       microseconds
+  --heap-dump FILE     write a heap snapshot to FILE on SIGUSR2
+  --cycle-check N      report reference cycles which leaked, every N top
+                       level forms
+  --break-cycles       also break the cycles found, freeing them
+  --deferred-free      free long lists on a background thread
+  --max-heap MB        fail allocations once a script, server request or
+                       interpreter session holds MB of objects
+  --max-steps N        fail top level forms and server requests after N
+                       evaluation steps
+  --timeout MS         fail top level forms and server requests after MS
+                       milliseconds
+  --isolate            give each connection its own environment
+  --isolate-requests   undo the changes each request makes
+  --prefork N          serve from N pre-forked worker processes
+  --max-requests N     recycle a worker after N requests
+  --max-rss-growth MB  recycle a worker once its memory grew by MB
+)";
+    std::exit(1);
+}
+
+// Benchmarks include this file with MLISP_NO_MAIN to drive the interpreter
+// themselves.
+#ifndef MLISP_NO_MAIN
 int main(int argc, char *argv[]) {
+    bool batch = false;
+    ServeOptions serve_opts;
+    std::string socket_path;
+    std::string profile_path;
+    bool call_profile = false;
+    bool alloc_profile = false;
+    bool perf_counters = false;
+    bool stats = false;
+    std::string trace_path;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--auto-parallel") {
+            // With a single worker, handing arguments to it only adds the
+            // dispatch.
+            AUTO_PARALLEL = PARALLEL_WORKERS > 1;
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--isolate") {
+            serve_opts.isolate = true;
+        } else if (arg == "--isolate-requests") {
+            serve_opts.isolate_requests = true;
+        } else if (arg == "--prefork" && i + 1 < argc) {
+            serve_opts.workers = std::atoi(argv[++i]);
+        } else if (arg == "--max-requests" && i + 1 < argc) {
+            serve_opts.max_requests = std::atol(argv[++i]);
+        } else if (arg == "--max-rss-growth" && i + 1 < argc) {
+            serve_opts.max_rss_growth = std::atol(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (arg == "--call-profile") {
+            call_profile = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--trace-calls" && i + 1 < argc) {
+            TRACE_CALL_THRESHOLD_NS = std::atol(argv[++i]) * 1000;
+        } else if (arg == "--slow-forms" && i + 1 < argc) {
+            SLOW_FORM_THRESHOLD_NS = std::atof(argv[++i]) * 1e6;
+        } else if (arg == "--heap-dump" && i + 1 < argc) {
+            HEAP_DUMP_PATH = argv[++i];
+        } else if (arg == "--cycle-check" && i + 1 < argc) {
+            CYCLE_CHECK_INTERVAL = std::max(1l, std::atol(argv[++i]));
+            TRACK_CONTAINERS = true;
+        } else if (arg == "--break-cycles") {
+            BREAK_CYCLES = true;
+        } else if (arg == "--max-heap" && i + 1 < argc) {
+            MAX_HEAP_BYTES = std::atol(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--max-steps" && i + 1 < argc) {
+            MAX_STEPS = std::max(0l, std::atol(argv[++i]));
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            TIMEOUT_MS = std::max(0l, std::atol(argv[++i]));
+        } else if (arg == "--deferred-free") {
+            DEFERRED_FREE = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--perf-counters") {
+            perf_counters = true;
+        } else if (arg == "--alloc-profile" && i + 1 < argc) {
+            alloc_profile = true;
+            ALLOC_SAMPLE_RATE = std::max(1l, std::atol(argv[++i]));
+        } else if (arg.rfind("--", 0) == 0) {
+            usage(argv[0]);
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    // Scans would race with the workers, or with the freer thread destroying
+    // the containers they walk.
+    if (batch && TRACK_CONTAINERS) {
+        std::cerr << "--cycle-check can't be used with --batch" << std::endl;
+        std::exit(1);
+    }
+    if (DEFERRED_FREE && TRACK_CONTAINERS) {
+        std::cerr << "--cycle-check can't be used with --deferred-free"
+                  << std::endl;
+        std::exit(1);
+    }
+    // Every list would be freed in place under the budget anyway.
+    if (DEFERRED_FREE && MAX_HEAP_BYTES > 0) {
+        std::cerr << "--max-heap can't be used with --deferred-free"
+                  << std::endl;
+        std::exit(1);
+    }
+
     Env env = default_env();
-    if (argc == 2) {
-        std::ifstream ifs(argv[1]);
-        if (!ifs) {
-            std::cerr << "faild to open file " << argv[1] << std::endl;
+    if (!profile_path.empty()) {
+        start_sampling_profiler(1000);
+    }
+    if (call_profile) {
+        INSTRUMENTATION |= INSTRUMENT_CALL_PROFILE;
+    }
+    if (alloc_profile) {
+        // Allocations are attributed to the top of the shadow stack.
+        INSTRUMENTATION |= INSTRUMENT_SHADOW_STACK;
+    }
+    if (!trace_path.empty() && !start_trace(trace_path)) {
+        std::cerr << "faild to open file " << trace_path << std::endl;
+        std::exit(1);
+    }
+    if (SLOW_FORM_THRESHOLD_NS >= 0) {
+        install_form_latency_dump_handler();
+    }
+    if (!HEAP_DUMP_PATH.empty()) {
+        install_heap_dump_handler();
+    }
+    std::unique_ptr<PerfCounters> counters;
+    if (perf_counters) {
+        counters.reset(new PerfCounters());
+        counters->start();
+    }
+
+    int status = 0;
+    if (!socket_path.empty()) {
+        status = serve(socket_path, env, serve_opts);
+    } else if (batch) {
+        // Without arguments the scripts are listed on stdin, one per line.
+        if (files.empty()) {
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty()) {
+                    files.push_back(line);
+                }
+            }
+        }
+        status = run_batch(files, env);
+    } else if (files.size() == 1) {
+        std::string content;
+        if (!read_file(files[0], content)) {
+            std::cerr << "faild to open file " << files[0] << std::endl;
             std::exit(1);
         }
-        std::string content((std::istreambuf_iterator<char>(ifs)),
-                            std::istreambuf_iterator<char>());
-        run(content, env);
-    } else {
+        status = run(content, env, files[0]) ? 0 : 1;
+    } else if (files.empty()) {
         interpreter(env);
+    } else {
+        usage(argv[0]);
+    }
+
+    if (!profile_path.empty()) {
+        stop_sampling_profiler(profile_path);
+    }
+    if (call_profile) {
+        print_call_profile(std::cerr, CallProfiler::collect());
+    }
+    if (alloc_profile) {
+        print_alloc_stats(std::cerr);
+    }
+    if (counters != nullptr) {
+        counters->stop();
+        counters->report(std::cerr);
+    }
+    if (!trace_path.empty()) {
+        stop_trace();
+    }
+    if (stats) {
+        print_stats(std::cerr, env);
+    }
+    if (SLOW_FORM_THRESHOLD_NS >= 0) {
+        FORM_LATENCY.print(std::cerr);
     }
+#ifdef MLISP_DISPATCH_STATS
+    print_dispatch_stats(std::cerr, env, 20);
+#endif
+    return status;
 }
+#endif
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""Finds what holds memory in a heap snapshot of mlisp.
+
+Reads a snapshot written by `(dump-heap FILE)` or `--heap-dump FILE`, and
+computes the dominator tree of the object graph from the bindings. The
+retained size of an object is the bytes which would be freed if it were, that
+is the bytes of the objects it dominates. Prints the bindings and objects
+which retain the most, and how many live objects no binding reaches, which
+are leaked cycles or objects only referenced from the stack.
+"""
+
+import argparse
+import collections
+import sys
+
+
+class Snapshot:
+    def __init__(self, f):
+        self.kinds = {}
+        self.sizes = {}
+        self.refs = {}
+        self.names = {}
+        self.roots = []
+        self.live = None
+        for line in f:
+            fields = line.split()
+            if not fields:
+                continue
+            tag = fields[0]
+            if tag == "o":
+                obj = int(fields[1])
+                self.kinds[obj] = fields[2]
+                self.sizes[obj] = int(fields[3])
+                self.refs[obj] = [int(ref) for ref in fields[4:]]
+            elif tag == "n":
+                self.names[int(fields[1])] = fields[2]
+            elif tag == "r":
+                self.roots.append((int(fields[1]), fields[2]))
+            elif tag == "live":
+                self.live = (int(fields[1]), int(fields[2]))
+
+    def label(self, obj):
+        name = self.names.get(obj)
+        kind = self.kinds[obj]
+        return "%s %s" % (kind, name) if name else "%s #%d" % (kind, obj)
+
+
+# The dominator tree is rooted at this, which references every binding.
+ROOT = 0
+
+
+def dominators(snapshot):
+    """Returns the immediate dominators and the reverse postorder.
+
+    Uses the iterative algorithm of Cooper, Harvey and Kennedy.
+    """
+    succs = dict(snapshot.refs)
+    succs[ROOT] = [obj for obj, _ in snapshot.roots]
+
+    postorder = []
+    visited = {ROOT}
+    stack = [(ROOT, iter(succs[ROOT]))]
+    while stack:
+        node, children = stack[-1]
+        for child in children:
+            if child not in visited:
+                visited.add(child)
+                stack.append((child, iter(succs[child])))
+                break
+        else:
+            stack.pop()
+            postorder.append(node)
+    order = {node: i for i, node in enumerate(postorder)}
+    rpo = list(reversed(postorder))
+
+    preds = collections.defaultdict(list)
+    for node in rpo:
+        for child in succs[node]:
+            preds[child].append(node)
+
+    idom = {ROOT: ROOT}
+
+    def intersect(a, b):
+        while a != b:
+            while order[a] < order[b]:
+                a = idom[a]
+            while order[b] < order[a]:
+                b = idom[b]
+        return a
+
+    changed = True
+    while changed:
+        changed = False
+        for node in rpo[1:]:
+            new = None
+            for pred in preds[node]:
+                if pred in idom:
+                    new = pred if new is None else intersect(pred, new)
+            if idom.get(node) != new:
+                idom[node] = new
+                changed = True
+    return idom, rpo
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("snapshot", help="file written by dump-heap")
+    parser.add_argument("-n", "--top", type=int, default=20,
+                        help="objects and bindings to list (default: 20)")
+    args = parser.parse_args()
+
+    with open(args.snapshot) as f:
+        snapshot = Snapshot(f)
+    idom, rpo = dominators(snapshot)
+
+    retained = {node: snapshot.sizes.get(node, 0) for node in rpo}
+    for node in reversed(rpo[1:]):
+        retained[idom[node]] += retained[node]
+
+    # Bindings which dominate each object, to tell where it hangs from.
+    names = collections.defaultdict(list)
+    for obj, name in snapshot.roots:
+        names[obj].append(name)
+    binding = {obj: ",".join(sorted(objs)) for obj, objs in names.items()}
+
+    def owner(node):
+        while idom[node] != ROOT:
+            node = idom[node]
+        return binding.get(node, "?")
+
+    reachable = len(rpo) - 1
+    print("reachable: %d objects, %d bytes" % (reachable, retained[ROOT]))
+    if snapshot.live is not None:
+        print("not reachable: %d objects, %d bytes" %
+              (snapshot.live[0] - reachable,
+               snapshot.live[1] - retained[ROOT]))
+
+    by_kind = collections.Counter()
+    for node in rpo[1:]:
+        by_kind[snapshot.kinds[node]] += snapshot.sizes[node]
+    print("\n%-26s %12s" % ("kind", "bytes"))
+    for kind, size in by_kind.most_common():
+        print("%-26s %12d" % (kind, size))
+
+    roots = sorted({obj for obj, _ in snapshot.roots},
+                   key=lambda obj: -retained[obj])
+    print("\n%-32s %12s  %s" % ("binding", "retained", "object"))
+    for obj in roots[:args.top]:
+        print("%-32s %12d  %s" % (binding[obj], retained[obj],
+                                   snapshot.label(obj)))
+
+    nodes = sorted(rpo[1:], key=lambda node: -retained[node])
+    print("\n%-40s %12s %10s  %s" % ("object", "retained", "own", "binding"))
+    for node in nodes[:args.top]:
+        print("%-40s %12d %10d  %s" % (snapshot.label(node), retained[node],
+                                        snapshot.sizes[node], owner(node)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())